@@ -0,0 +1,471 @@
+/*
+ * Sound backends.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <linux/kd.h>
+
+#include "backend.h"
+#include "render.h"
+#include "discover.h"
+
+static int write_event(int fd, int type, int code, int value)
+{
+	struct input_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = type;
+	ev.code = code;
+	ev.value = value;
+	return write(fd, &ev, sizeof(ev)) == sizeof(ev) ? 0 : -1;
+}
+
+static void fd_close(struct backend *b)
+{
+	close(b->fd);
+}
+
+static int evdev_open(struct backend *b, const char *arg)
+{
+	if (!arg) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((b->fd = open(arg, O_WRONLY | O_CLOEXEC)) < 0)
+		return -1;
+	/* Tones are written only to beepers */
+	if (!snd_tone_supported(b->fd)) {
+		close(b->fd);
+		errno = ENODEV;
+		return -1;
+	}
+	return 0;
+}
+
+static int evdev_tone(struct backend *b, int freq)
+{
+	return write_event(b->fd, EV_SND, SND_TONE, freq);
+}
+
+static int evdev_bell(struct backend *b, int on)
+{
+	return write_event(b->fd, EV_SND, SND_BELL, on);
+}
+
+static int null_open(struct backend *b, const char *arg)
+{
+	b->fd = -1;
+	return 0;
+}
+
+static int null_tone(struct backend *b, int freq)
+{
+	return 0;
+}
+
+static void null_close(struct backend *b)
+{
+}
+
+static int file_open(struct backend *b, const char *arg)
+{
+	if (!arg) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!strcmp(arg, "-")) {
+		b->fd = dup(STDOUT_FILENO);
+	} else {
+		b->fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	return b->fd < 0 ? -1 : 0;
+}
+
+static int file_tone(struct backend *b, int freq)
+{
+	struct input_event ev;
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	memset(&ev, 0, sizeof(ev));
+	ev.input_event_sec = t.tv_sec;
+	ev.input_event_usec = t.tv_nsec / 1000;
+	ev.type = EV_SND;
+	ev.code = SND_TONE;
+	ev.value = freq;
+	return write(b->fd, &ev, sizeof(ev)) == sizeof(ev) ? 0 : -1;
+}
+
+static int uinput_open(struct backend *b, const char *arg)
+{
+	struct uinput_setup us;
+	int err;
+
+	if ((b->fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK)) < 0)
+		return -1;
+
+	memset(&us, 0, sizeof(us));
+	us.id.bustype = BUS_VIRTUAL;
+	strncpy(us.name, arg ? arg : "beep_melody", sizeof(us.name) - 1);
+	if (ioctl(b->fd, UI_SET_EVBIT, EV_SND)
+	  || ioctl(b->fd, UI_SET_SNDBIT, SND_TONE)
+	  || ioctl(b->fd, UI_DEV_SETUP, &us)
+	  || ioctl(b->fd, UI_DEV_CREATE)) {
+		err = errno;
+		close(b->fd);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/* Events of virtual device reach its readers on SYN_REPORT */
+static int uinput_tone(struct backend *b, int freq)
+{
+	if (write_event(b->fd, EV_SND, SND_TONE, freq))
+		return -1;
+	return write_event(b->fd, EV_SYN, SYN_REPORT, 0);
+}
+
+static void uinput_close(struct backend *b)
+{
+	ioctl(b->fd, UI_DEV_DESTROY);
+	close(b->fd);
+}
+
+/* Input frequency of PC speaker timer, KIOCSOUND takes its divisor */
+#define CONSOLE_CLOCK_HZ 1193182
+
+static int console_open(struct backend *b, const char *arg)
+{
+	int err;
+
+	if ((b->fd = open(arg ? arg : "/dev/tty0", O_WRONLY)) < 0)
+		return -1;
+	/* Not a console, if it can't turn tone off */
+	if (ioctl(b->fd, KIOCSOUND, 0)) {
+		err = errno;
+		close(b->fd);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static int console_tone(struct backend *b, int freq)
+{
+	return ioctl(b->fd, KIOCSOUND, CONSOLE_CLOCK_HZ / freq);
+}
+
+static int console_off(struct backend *b)
+{
+	return ioctl(b->fd, KIOCSOUND, 0);
+}
+
+/*
+ * PWM channel: tone is period, duty cycle is half of it. Channel
+ * is enabled on tone and disabled to turn it off, so off and on
+ * without change of tone are single writes.
+ */
+struct pwm_state {
+	int period_fd, duty_fd, enable_fd;
+	long period; /* nsec, 0 -- not set yet */
+	int enabled;
+};
+
+static int pwm_write(int fd, long val)
+{
+	char buf[32];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%ld\n", val);
+	return pwrite(fd, buf, len, 0) == len ? 0 : -1;
+}
+
+/* Export channel PATH (.../pwmchipN/pwmM) by writing M to .../pwmchipN/export */
+static int pwm_export(const char *path)
+{
+	const char *base = strrchr(path, '/');
+	char buf[4096];
+	int fd, len, err;
+
+	if (!base || strncmp(base + 1, "pwm", 3) || !base[4]) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (snprintf(buf, sizeof(buf), "%.*s/export", (int)(base - path), path)
+	  >= sizeof(buf)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if ((fd = open(buf, O_WRONLY)) < 0)
+		return -1;
+	len = strlen(base + 4);
+	err = write(fd, base + 4, len) == len ? 0 : -1;
+	close(fd);
+	return err;
+}
+
+static int pwm_open_attr(const char *path, const char *attr)
+{
+	char buf[4096];
+
+	if (snprintf(buf, sizeof(buf), "%s/%s", path, attr) >= sizeof(buf)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return open(buf, O_WRONLY);
+}
+
+static void pwm_free(struct pwm_state *p)
+{
+	if (p->period_fd >= 0)
+		close(p->period_fd);
+	if (p->duty_fd >= 0)
+		close(p->duty_fd);
+	if (p->enable_fd >= 0)
+		close(p->enable_fd);
+	free(p);
+}
+
+static int pwm_open(struct backend *b, const char *arg)
+{
+	struct pwm_state *p;
+	int err;
+
+	if (!arg) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (access(arg, F_OK) && pwm_export(arg))
+		return -1;
+	if (!(p = calloc(1, sizeof(*p))))
+		return -1;
+	p->period_fd = pwm_open_attr(arg, "period");
+	p->duty_fd = pwm_open_attr(arg, "duty_cycle");
+	p->enable_fd = pwm_open_attr(arg, "enable");
+	/* Zero duty cycle fits any period */
+	if (p->period_fd < 0 || p->duty_fd < 0 || p->enable_fd < 0
+	  || pwm_write(p->enable_fd, 0) || pwm_write(p->duty_fd, 0)) {
+		err = errno;
+		pwm_free(p);
+		errno = err;
+		return -1;
+	}
+	b->fd = -1;
+	b->priv = p;
+	return 0;
+}
+
+static int pwm_tone(struct backend *b, int freq)
+{
+	struct pwm_state *p = b->priv;
+	long period = 1000000000L / freq;
+
+	if (period != p->period) {
+		/* Duty cycle must not exceed period at any moment */
+		if (period < p->period) {
+			if (pwm_write(p->duty_fd, period / 2)
+			  || pwm_write(p->period_fd, period))
+				return -1;
+		} else {
+			if (pwm_write(p->period_fd, period)
+			  || pwm_write(p->duty_fd, period / 2))
+				return -1;
+		}
+		p->period = period;
+	}
+	if (!p->enabled) {
+		if (pwm_write(p->enable_fd, 1))
+			return -1;
+		p->enabled = 1;
+	}
+	return 0;
+}
+
+static int pwm_off(struct backend *b)
+{
+	struct pwm_state *p = b->priv;
+
+	if (!p->enabled)
+		return 0;
+	if (pwm_write(p->enable_fd, 0))
+		return -1;
+	p->enabled = 0;
+	return 0;
+}
+
+static void pwm_close(struct backend *b)
+{
+	pwm_off(b);
+	pwm_free(b->priv);
+}
+
+struct wav_state {
+	struct renderer r;
+	struct timespec start; /* Of the first tone */
+	int freq;
+};
+
+static int wav_open(struct backend *b, const char *arg)
+{
+	struct wav_state *w;
+
+	if (!arg) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!(w = calloc(1, sizeof(*w))))
+		return -1;
+	if (render_open(&w->r, arg, RENDER_RATE)) {
+		free(w);
+		return -1;
+	}
+	b->fd = w->r.fd;
+	b->priv = w;
+	return 0;
+}
+
+/* Render the previous tone up to now */
+static int wav_tone(struct backend *b, int freq)
+{
+	struct wav_state *w = b->priv;
+	struct timespec t;
+	long long sec, nsec;
+	uint64_t n;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	if (!w->r.n_samples && !w->freq) {
+		w->start = t;
+	} else {
+		sec = t.tv_sec - w->start.tv_sec;
+		nsec = t.tv_nsec - w->start.tv_nsec;
+		n = sec * w->r.rate + nsec * w->r.rate / 1000000000;
+		if (n > w->r.n_samples
+		  && render_tone(&w->r, w->freq, n - w->r.n_samples))
+			return -1;
+	}
+	w->freq = freq;
+	return 0;
+}
+
+static int wav_batch(struct backend *b, const struct note_event *events,
+  int n_events)
+{
+	struct wav_state *w = b->priv;
+
+	return render_events(&w->r, events, n_events);
+}
+
+static void wav_close(struct backend *b)
+{
+	struct wav_state *w = b->priv;
+
+	/* Trailing silence isn't rendered */
+	if (w->freq)
+		wav_tone(b, 0);
+	render_close(&w->r);
+	free(w);
+}
+
+static int group_tone(struct backend *b, int freq)
+{
+	struct timespec first, last;
+	int i, err = 0;
+
+	for (i = 0; i < b->n_members; i++) {
+		if (backend_tone(&b->members[i], freq))
+			err = -1;
+		if (!i)
+			clock_gettime(CLOCK_MONOTONIC, &first);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	b->skew_nsec = (last.tv_sec - first.tv_sec) * 1000000000L
+	  + last.tv_nsec - first.tv_nsec;
+	return err;
+}
+
+static int group_bell(struct backend *b, int on)
+{
+	int i, err = 0;
+
+	for (i = 0; i < b->n_members; i++) {
+		if (backend_bell(&b->members[i], on))
+			err = -1;
+	}
+	return err;
+}
+
+static void group_close(struct backend *b)
+{
+	int i;
+
+	for (i = 0; i < b->n_members; i++)
+		backend_close(&b->members[i]);
+	free(b->members);
+}
+
+static const struct backend_ops group_ops = {
+	.name = "group", .tone = group_tone, .bell = group_bell,
+	.close = group_close,
+};
+
+static const struct backend_ops backends[] = {
+	{ .name = "evdev", .open = evdev_open, .tone = evdev_tone,
+	  .bell = evdev_bell, .close = fd_close },
+	{ .name = "null", .open = null_open, .tone = null_tone,
+	  .close = null_close },
+	{ .name = "file", .open = file_open, .tone = file_tone,
+	  .close = fd_close },
+	{ .name = "uinput", .open = uinput_open, .tone = uinput_tone,
+	  .close = uinput_close },
+	{ .name = "console", .open = console_open, .tone = console_tone,
+	  .off = console_off, .close = fd_close },
+	{ .name = "pwm", .open = pwm_open, .tone = pwm_tone, .off = pwm_off,
+	  .close = pwm_close },
+	{ .name = "wav", .open = wav_open, .tone = wav_tone,
+	  .batch = wav_batch, .close = wav_close },
+};
+
+int backend_open(struct backend *b, const char *spec)
+{
+	const char *arg = strchr(spec, ':');
+	size_t len = arg ? arg - spec : strlen(spec);
+	int i;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (strlen(backends[i].name) != len
+		  || strncmp(backends[i].name, spec, len))
+			continue;
+		memset(b, 0, sizeof(*b));
+		b->ops = &backends[i];
+		return b->ops->open(b, arg ? arg + 1 : NULL);
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+void backend_group(struct backend *b, struct backend *members, int n)
+{
+	memset(b, 0, sizeof(*b));
+	b->ops = &group_ops;
+	b->fd = -1;
+	b->members = members;
+	b->n_members = n;
+}
+
+void backend_close(struct backend *b)
+{
+	b->ops->close(b);
+}
@@ -0,0 +1,111 @@
+/*
+ * Sound backends. Players (beep and beep_melody) set tones through
+ * struct backend, so the same schedule may be played on any beeper
+ * or recorded and checked without one. Every backend changes tones
+ * by its cheapest way, e.g. one ioctl for console.
+ *
+ * Backend is selected by spec string "<name>[:<arg>]":
+ *   evdev:PATH -- event device with EV_SND/SND_TONE (default),
+ *   null -- drop all tones,
+ *   file:PATH -- record tones as struct input_event with CLOCK_MONOTONIC
+ *     timestamps to file or pipe PATH ('-' -- stdout),
+ *   uinput[:NAME] -- create virtual EV_SND device via /dev/uinput,
+ *   console[:PATH] -- console KIOCSOUND ioctl on tty PATH (/dev/tty0),
+ *   pwm:PATH -- sysfs PWM channel PATH, e.g. /sys/class/pwm/pwmchip0/pwm0
+ *     (exported, if it isn't),
+ *   wav:PATH -- render tones to square wave WAV file or pipe PATH
+ *     ('-' -- stdout) in real time, from the first tone on; whole
+ *     melodies are rendered at once.
+ *
+ * Several opened backends may be joined into a group, which plays
+ * every tone on all of them at once.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "rtttl.h"
+
+/* Tone of bell on backends without one, as pcspkr plays it */
+#define BACKEND_BELL_HZ 1000
+
+struct backend;
+
+/* Optional ops may be NULL. All ops return 0 -- Ok, <0 -- error */
+struct backend_ops {
+	const char *name;
+	/* @arg -- text after ':' in spec, NULL if there was none */
+	int (*open)(struct backend *b, const char *arg);
+	/* Set tone @freq (0 -- off, if there is no off op) */
+	int (*tone)(struct backend *b, int freq);
+	/* Turn tone off. Optional, default is tone 0 */
+	int (*off)(struct backend *b);
+	/* Turn bell on or off. Optional, default is BACKEND_BELL_HZ tone */
+	int (*bell)(struct backend *b, int on);
+	/*
+	 * Play whole melody at once, instead of tone changes on
+	 * schedule. Optional, only for backends which don't need
+	 * real time, e.g. renderers.
+	 */
+	int (*batch)(struct backend *b, const struct note_event *events,
+	  int n_events);
+	void (*close)(struct backend *b);
+};
+
+struct backend {
+	const struct backend_ops *ops;
+	int fd;
+	void *priv; /* Backend state, if fd isn't enough */
+
+	/* Group */
+	struct backend *members;
+	int n_members;
+	long skew_nsec; /* Between the first and the last write of last tone */
+};
+
+/*
+ * Open backend by @spec.
+ *
+ * Return: 0 -- Ok, <0 -- error (see errno, EINVAL -- unknown backend),
+ */
+int backend_open(struct backend *b, const char *spec);
+
+/*
+ * Join @n opened backends @members into group @b. Every tone is
+ * written to members one after another in order. Group owns members
+ * and malloc'ed array @members, they are closed and freed with it.
+ */
+void backend_group(struct backend *b, struct backend *members, int n);
+
+void backend_close(struct backend *b);
+
+/* Set tone @freq, 0 -- off */
+static inline int backend_tone(struct backend *b, int freq)
+{
+	if (freq)
+		return b->ops->tone(b, freq);
+	return b->ops->off ? b->ops->off(b) : b->ops->tone(b, 0);
+}
+
+static inline int backend_bell(struct backend *b, int on)
+{
+	if (b->ops->bell)
+		return b->ops->bell(b, on);
+	return backend_tone(b, on ? BACKEND_BELL_HZ : 0);
+}
+
+/* Return: 1 -- backend plays melodies with backend_batch() */
+static inline int backend_has_batch(const struct backend *b)
+{
+	return !!b->ops->batch;
+}
+
+static inline int backend_batch(struct backend *b,
+  const struct note_event *events, int n_events)
+{
+	return b->ops->batch(b, events, n_events);
+}
+
+#endif
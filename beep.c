@@ -1,7 +1,7 @@
 /*
  * Make a single beep of user defined tone and duration on a beeper.
  *
- * Depends: Linux, input-evdev
+ * Depends: Linux, input-evdev (or other sound backend, see backend.h)
  *
  * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
  */
@@ -12,51 +12,210 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <limits.h>
 
 #include <linux/input.h>
 
+#include "discover.h"
+#include "backend.h"
+#include "engine.h"
+
 static void show_help(void) {
 	static const char *help_str =
 		"Make beep by sending input event to beeper.\n\n"
 		"Usage: beep [OPTIONS]\n\n"
 		"Options:\n"
-		"* -f HZ -- beep frequency (tone) in HZ. Default is 800,\n"
+		"* -f HZ -- beep frequency (tone) in HZ, 0 -- pause. Default is\n"
+		"*   the bell sound of beeper (SND_BELL),\n"
 		"* -d ms -- duration in milliseconds. Default is 200ms,\n"
-		"* -e N -- input event number (/dev/input/eventN). Default is 0,\n"
+		"*   '-f' and '-d' may be repeated to beep a sequence of tones,\n"
+		"*   e.g. '-f 440 -d 100 -f 880 -d 50',\n"
+		"* -s -- after tones of '-f'/'-d', beep sequence read from stdin:\n"
+		"*   HZ:ms tuples separated by spaces, commas or new lines, HZ=0\n"
+		"*   -- pause,\n"
+		"* -e N -- input event number (/dev/input/eventN) or 'auto' -- the\n"
+		"*   first beeper found in /dev/input. Default is 'auto',\n"
+		"* -B SPEC -- sound backend instead of event device: 'console[:TTY]'\n"
+		"*   -- KIOCSOUND ioctl on console TTY (/dev/tty0), 'pwm:PATH' --\n"
+		"*   sysfs PWM channel, 'wav:PATH' -- render to WAV file, 'file:PATH',\n"
+		"*   'uinput[:NAME]' or 'null',\n"
 		"* -h -- show this help,\n";
 
 	fprintf(stderr, "%s\n", help_str);
 }
 
-static int send_sound_event(int fd, int code, int val)
+#define MAX_DURATION_MS (INT_MAX / 1000) /* Deadlines are in usec */
+
+struct tone {
+	int code; /* SND_BELL or SND_TONE */
+	int freq; /* 0 -- pause */
+	int duration_ms;
+};
+
+/*
+ * Sequence player. Every tone starts at absolute deadline counted
+ * from the first one, so the next tone may be read while the
+ * current one sounds, and latencies don't accumulate.
+ */
+struct player {
+	struct backend *be;
+	int code, freq; /* Tone on device, freq=0 -- off */
+	int started;
+	struct timespec t; /* Start of the next tone */
+};
+
+/* Set tone of @code, @freq=0 -- off */
+static int set_tone(struct backend *be, int code, int freq)
+{
+	if (code == SND_BELL)
+		return backend_bell(be, !!freq);
+	return backend_tone(be, freq);
+}
+
+static void player_tone(struct player *p, const struct tone *tone)
+{
+	if (!p->started) {
+		clock_gettime(CLOCK_MONOTONIC, &p->t);
+		p->started = 1;
+	}
+	sleep_until(&p->t, NULL);
+	if (tone->code != p->code && p->freq) {
+		set_tone(p->be, p->code, 0);
+		p->freq = 0;
+	}
+	if (tone->freq != p->freq) {
+		set_tone(p->be, tone->code, tone->freq);
+		p->freq = tone->freq;
+	}
+	p->code = tone->code;
+	timespec_add_usec(&p->t, tone->duration_ms * 1000);
+}
+
+static void player_end(struct player *p)
+{
+	if (!p->started)
+		return;
+	sleep_until(&p->t, NULL);
+	if (p->freq)
+		set_tone(p->be, p->code, 0);
+}
+
+/*
+ * Play tones at once on backend with batch op.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int play_batch(struct backend *be, const struct tone *tones, int n)
+{
+	struct note_event *ev;
+	int i, err;
+
+	if (!(ev = malloc((n + 1) * sizeof(*ev))))
+		return -1;
+	for (i = 0; i < n; i++) {
+		ev[i].freq = tones[i].freq && tones[i].code == SND_BELL
+		  ? BACKEND_BELL_HZ : tones[i].freq;
+		ev[i].duration_usec = tones[i].duration_ms * 1000;
+	}
+	err = backend_batch(be, ev, n);
+	free(ev);
+	return err;
+}
+
+/*
+ * Read the next HZ:ms tuple of sequence.
+ *
+ * Return: 1 -- Ok, 0 -- end of input, <0 -- invalid tuple,
+ */
+static int read_tone(FILE *f, struct tone *tone)
 {
-	static struct input_event ev;
+	int n;
+
+	fscanf(f, "%*[ \t\r\n,]");
+	n = fscanf(f, "%d:%d", &tone->freq, &tone->duration_ms);
+	if (n == EOF)
+		return 0;
+	if (n != 2 || tone->freq < 0 || tone->duration_ms <= 0
+	  || tone->duration_ms > MAX_DURATION_MS)
+		return -1;
+	tone->code = SND_TONE;
+	return 1;
+}
 
-	ev.type = EV_SND;
-	ev.code = code;
-	ev.value = val;
+/*
+ * Parse integer option argument @s to @v, it must be in @min..@max.
+ *
+ * Return: 0 -- Ok, <0 -- invalid number,
+ */
+static int parse_int(const char *s, int min, int max, int *v)
+{
+	char *end;
+	long n;
 
-	return write(fd, &ev, sizeof(ev)) != sizeof(ev);
+	errno = 0;
+	n = strtol(s, &end, 10);
+	if (errno || end == s || *end || n < min || n > max)
+		return -1;
+	*v = n;
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
-	int c, fd;
+	int c, i, n_tones = 0, seq = 0, err = 0;
 	int snd_code = SND_BELL;
-	int freq = 1, duration_ms = 200, event_num = 0;
+	int freq = 1, duration_ms = 200, n;
+	int have_freq = 0, have_duration = 0, status = 0;
+	struct tone *tones, tone;
+	struct player p = { 0 };
+	const char *event = "auto", *backend = NULL;
 	char event_dev[256];
+	struct backend be;
+	struct snd_device dev[DISCOVER_MAX];
 
-	while ((c = getopt(argc, argv, "d:f:e:h")) != -1) {
+	/*
+	 * Every -f/-d option takes at least one argument ('-f440'), so
+	 * there are at most argc tones
+	 */
+	if (!(tones = calloc(argc + 1, sizeof(*tones)))) {
+		fprintf(stderr, "Failed to allocate tones\n");
+		return 1;
+	}
+
+	while ((c = getopt(argc, argv, "d:f:e:B:sh")) != -1) {
+		/* Repeated option starts the next tone */
+		if (c == 'd' && have_duration || c == 'f' && have_freq) {
+			tones[n_tones++] = (struct tone){ snd_code, freq,
+			  duration_ms };
+			have_freq = have_duration = 0;
+		}
 		switch(c) {
 		case 'd':
-			duration_ms = atoi(optarg);
+			if (parse_int(optarg, 1, MAX_DURATION_MS, &duration_ms)) {
+				fprintf(stderr, "Invalid duration \"%s\", expected "
+				  "ms > 0\n", optarg);
+				return 1;
+			}
+			have_duration = 1;
 			break;
 		case 'f':
-			freq = atoi(optarg);
+			if (parse_int(optarg, 0, INT_MAX, &freq)) {
+				fprintf(stderr, "Invalid frequency \"%s\", expected "
+				  "HZ >= 0\n", optarg);
+				return 1;
+			}
 			snd_code = SND_TONE;
+			have_freq = 1;
+			break;
+		case 's':
+			seq = 1;
 			break;
 		case 'e':
-			event_num = atoi(optarg);
+			event = optarg;
+			break;
+		case 'B':
+			backend = optarg;
 			break;
 		case 'h':
 			show_help();
@@ -73,17 +232,66 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	snprintf(event_dev, sizeof(event_dev), "/dev/input/event%d", event_num);
-	if ((fd = open(event_dev, O_WRONLY)) < 0) {
-		fprintf(stderr, "Failed to open event device \"%s\": %s\n",
-			event_dev, strerror(errno));
-		return 1;
+	if (backend) {
+		if (backend_open(&be, backend)) {
+			fprintf(stderr, "Failed to open backend \"%s\": %s\n",
+			  backend, strerror(errno));
+			return 1;
+		}
+	} else {
+		if (!strcmp(event, "auto")) {
+			if ((n = discover_devices(dev, DISCOVER_MAX, 0)) <= 0) {
+				fprintf(stderr, "No beeper found in %s, use '-e N'\n",
+				  DISCOVER_DIR);
+				return 1;
+			}
+			snprintf(event_dev, sizeof(event_dev), "evdev:%s",
+			  dev[0].path);
+		} else {
+			snprintf(event_dev, sizeof(event_dev),
+			  "evdev:/dev/input/event%d", atoi(event));
+		}
+		n = backend_open(&be, event_dev);
+		/* Cached beeper may be gone, look it up again */
+		if (n && !strcmp(event, "auto")
+		  && (errno == ENOENT || errno == ENODEV || errno == ENXIO)
+		  && discover_devices(dev, DISCOVER_MAX, 1) > 0) {
+			snprintf(event_dev, sizeof(event_dev), "evdev:%s",
+			  dev[0].path);
+			n = backend_open(&be, event_dev);
+		}
+		if (n) {
+			fprintf(stderr, "Failed to open event device \"%s\": %s\n",
+				event_dev + strlen("evdev:"), strerror(errno));
+			return 1;
+		}
 	}
 
-	send_sound_event(fd, snd_code, freq);
-	usleep(duration_ms * 1000);
-	send_sound_event(fd, snd_code, 0);
+	/* The last (or the only) tone */
+	if (have_freq || have_duration || !seq && !n_tones)
+		tones[n_tones++] = (struct tone){ snd_code, freq, duration_ms };
+
+	if (backend_has_batch(&be) && !seq) {
+		if ((err = play_batch(&be, tones, n_tones)))
+			fprintf(stderr, "Failed to play tones: %s\n",
+			  strerror(errno));
+	} else {
+		p.be = &be;
+		for (i = 0; i < n_tones; i++)
+			player_tone(&p, &tones[i]);
+		while (seq && (status = read_tone(stdin, &tone)) > 0)
+			player_tone(&p, &tone);
+		player_end(&p);
+	}
 
-	close(fd);
+	backend_close(&be);
+	free(tones);
+	if (err)
+		return 1;
+	if (status < 0) {
+		fprintf(stderr, "Invalid tone in sequence, expected HZ:ms "
+		  "(ms > 0)\n");
+		return 1;
+	}
 	return 0;
 }
@@ -8,9 +8,14 @@
  *
  * Usage example: ./beep_melody <<<"TheLambada:d=8,o=5,b=125:4d.6,c6,a#,a,4g,g,a#,a,g,f,g,d,c,2d.,4d.6,c6,a#,a,4g,g,a#,a,g,f,g,d.,c,2d,c6,c6,c6,a#,4d#,d#,g,d.6,c.6,a#,4d#,g,a#,4a,g,f,4f,g,f,2g"
  *
+ * Daemon usage example: ./beep_melody -s /run/beep_melody.sock &
+ *   ./beep_melody -c /run/beep_melody.sock <<<"Beep:d=4,o=5,b=120:c,e,g"
+ *
  * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
  */
 
+#define _GNU_SOURCE /* CPU affinity */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,376 +24,2726 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <getopt.h>
+#include <time.h>
+#include <signal.h>
+#include <glob.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sched.h>
+
+
+#include "rtttl.h"
+#include "melody_bin.h"
+#include "backend.h"
+#include "engine.h"
+#include "discover.h"
+#include "ring.h"
+#include "render.h"
+#include "metrics.h"
+#include "trace.h"
+
+static int debug;
+
+/* Real-time playback: SCHED_FIFO priority (0 -- off), CPU (-1 -- any) */
+static int rt_prio;
+static int rt_cpu = -1;
+
+/* Transformation of played melodies */
+static struct transform xform;
+
+/* Note frequencies and articulation of compiled melodies */
+static struct tuning tuning;
+static int gap_pct = ARTICULATION_NORMAL;
+
+/* Timing report output, NULL -- timing isn't measured */
+static FILE *timing_out;
+
+enum log_levels {
+	LOG_DBG=0,
+	LOG_INFO=1,
+	LOG_WARN=2,
+	LOG_ERR=9,
+};
+
+/*
+ * Debug messages go to trace ring, they don't disturb playback
+ * timing. Build with NO_DEBUG to compile them out.
+ */
+#ifdef NO_DEBUG
+#define DEBUG(frmt, ...) do { \
+	if (0) \
+		trace_log(frmt, ##__VA_ARGS__); \
+} while (0)
+#else
+#define DEBUG(frmt, ...) do { \
+	if (debug) \
+		trace_log(frmt, ##__VA_ARGS__); \
+} while (0)
+#endif
+#define WARN(frmt, ...)  _log(LOG_WARN, frmt, ##__VA_ARGS__)
+#define ERR(frmt, ...)   _log(LOG_ERR, frmt, ##__VA_ARGS__)
+
+static const char *log_level_str[] = {
+	[LOG_DBG] = "DEBUG",
+	[LOG_INFO] = "INFO",
+	[LOG_WARN] = "WARNING",
+	[LOG_ERR] = "ERROR",
+};
+
+static void _vlog(int level, const char *frmt, va_list args)
+{
+	/* Keep order with debug messages logged before */
+	if (debug)
+		trace_flush();
+
+	/* Don't mix lines logged by different threads */
+	flockfile(stderr);
+	fprintf(stderr, "%s: ", log_level_str[level]);
+	vfprintf(stderr, frmt, args);
+	fprintf(stderr, "\n");
+	funlockfile(stderr);
+}
+
+static void _log(int level, const char *frmt, ...)
+{
+	va_list args;
+
+	va_start(args, frmt);
+	_vlog(level, frmt, args);
+	va_end(args);
+}
+
+/* Format debug messages of melody, when it is over */
+static void debug_flush(void)
+{
+	if (debug)
+		trace_kick();
+}
+
+/* Parser with debug flag, tuning and articulation of this program */
+static void melody_parser_init(struct parser *ps, char *err, int err_size)
+{
+	parser_init(ps, debug, err, err_size);
+	ps->tuning = &tuning;
+	ps->gap_pct = gap_pct;
+}
+
+/* Sleep until absolute CLOCK_MONOTONIC time @t */
+/* Set by SIGINT/SIGTERM: local playback turns beeper off and ends */
+static volatile sig_atomic_t stopped;
+
+static void on_stop(int sig)
+{
+	stopped = 1;
+}
+
+/*
+ * Timing of tone changes: lateness of every device write relative
+ * to its deadline. Lateness is counted in log2 buckets: bucket i
+ * holds values in [2^(i-1), 2^i) usec, bucket 0 -- 0 usec. When
+ * several devices play the same melody, skew between the first and
+ * the last device write of every tone is counted too. Deadline and
+ * time of the first TIMING_RECORDS writes are kept for per-write lines
+ * of the report. Only the playing thread updates it.
+ */
+#define TIMING_BUCKETS 32
+#define TIMING_RECORDS 4096
+
+struct timing_rec {
+	struct timespec deadline;
+	struct timespec actual;
+	long late; /* usec */
+};
+
+static struct {
+	long n;
+	long sum, max; /* usec */
+	long first, last; /* Lateness of the first and of the last write */
+	long skew_sum, skew_max; /* nsec */
+	long start_latency; /* Daemon: submit to the first tone, usec */
+	unsigned long hist[TIMING_BUCKETS];
+	struct timing_rec *recs; /* TIMING_RECORDS, NULL -- not kept */
+} timing = { .start_latency = -1 };
+
+/* Return: how late is @now for @deadline, usec, >= 0 */
+static long lateness_usec(const struct timespec *deadline,
+  struct timespec *now)
+{
+	long late;
+
+	clock_gettime(CLOCK_MONOTONIC, now);
+	late = (now->tv_sec - deadline->tv_sec) * 1000000
+	  + (now->tv_nsec - deadline->tv_nsec) / 1000;
+	return late < 0 ? 0 : late;
+}
+
+/* Account write to @be done at @now, @late usec after its @deadline */
+static void timing_add(const struct backend *be,
+  const struct timespec *deadline, const struct timespec *now, long late)
+{
+	int i;
+
+	if (timing.recs && timing.n < TIMING_RECORDS)
+		timing.recs[timing.n] = (struct timing_rec){ *deadline, *now,
+		  late };
+
+	i = late ? 64 - __builtin_clzl(late) : 0;
+	if (i >= TIMING_BUCKETS)
+		i = TIMING_BUCKETS - 1;
+	timing.hist[i]++;
+
+	if (!timing.n)
+		timing.first = late;
+	timing.last = late;
+	timing.n++;
+	timing.sum += late;
+	if (late > timing.max)
+		timing.max = late;
+
+	timing.skew_sum += be->skew_nsec;
+	if (be->skew_nsec > timing.skew_max)
+		timing.skew_max = be->skew_nsec;
+}
+
+/* Return: upper bound of lateness of @pct percent of writes, usec */
+static long timing_percentile(int pct)
+{
+	unsigned long want, seen = 0;
+	long bound;
+	int i;
+
+	want = (timing.n * pct + 99) / 100;
+	for (i = 0; i < TIMING_BUCKETS; i++) {
+		seen += timing.hist[i];
+		if (seen >= want && seen)
+			break;
+	}
+	bound = i ? (1L << i) - 1 : 0;
+	return bound < timing.max ? bound : timing.max;
+}
+
+/*
+ * Print timing report as "key: value" lines and reset counters.
+ * Every write gets "write: INDEX DEADLINE ACTUAL LATENESS_USEC" line
+ * (CLOCK_MONOTONIC seconds) first, then the summary follows. Drift is
+ * lateness of the last write minus lateness of the first one, i.e.
+ * how much the schedule slipped during playback.
+ */
+static void timing_print(void)
+{
+	struct timing_rec *recs;
+	const struct timing_rec *r;
+	long i;
+
+	if (!timing_out)
+		return;
+
+	flockfile(timing_out);
+	for (i = 0; timing.recs && i < timing.n && i < TIMING_RECORDS; i++) {
+		r = &timing.recs[i];
+		fprintf(timing_out, "write: %ld %ld.%09ld %ld.%09ld %ld\n", i,
+		  (long)r->deadline.tv_sec, r->deadline.tv_nsec,
+		  (long)r->actual.tv_sec, r->actual.tv_nsec, r->late);
+	}
+	if (timing.n > TIMING_RECORDS)
+		fprintf(timing_out, "writes_not_listed: %ld\n",
+		  timing.n - TIMING_RECORDS);
+	fprintf(timing_out, "writes: %ld\n", timing.n);
+	fprintf(timing_out, "lateness_mean_usec: %ld\n",
+	  timing.n ? timing.sum / timing.n : 0);
+	fprintf(timing_out, "lateness_p50_usec: %ld\n", timing_percentile(50));
+	fprintf(timing_out, "lateness_p99_usec: %ld\n", timing_percentile(99));
+	fprintf(timing_out, "lateness_max_usec: %ld\n", timing.max);
+	fprintf(timing_out, "drift_usec: %ld\n", timing.last - timing.first);
+	fprintf(timing_out, "skew_mean_usec: %ld\n",
+	  timing.n ? timing.skew_sum / timing.n / 1000 : 0);
+	fprintf(timing_out, "skew_max_usec: %ld\n", timing.skew_max / 1000);
+	if (timing.start_latency >= 0)
+		fprintf(timing_out, "submit_to_first_tone_usec: %ld\n",
+		  timing.start_latency);
+	for (i = 0; i < TIMING_BUCKETS; i++) {
+		if (timing.hist[i])
+			fprintf(timing_out, "hist_le_usec_%ld: %lu\n",
+			  i ? (1L << i) - 1 : 0, timing.hist[i]);
+	}
+	fflush(timing_out);
+	funlockfile(timing_out);
+
+	recs = timing.recs;
+	memset(&timing, 0, sizeof(timing));
+	timing.start_latency = -1;
+	timing.recs = recs;
+}
+
+/*
+ * Switch calling thread to real-time playback mode: lock memory,
+ * pin to CPU, set SCHED_FIFO priority and pre-fault stack. Steps
+ * which fail (e.g. due to missing CAP_SYS_NICE or CAP_IPC_LOCK)
+ * are skipped with a warning, so playback just goes on with less
+ * timing guarantees.
+ */
+static void rt_setup(void)
+{
+	struct sched_param sp = { .sched_priority = rt_prio };
+	volatile char stack[64 * 1024];
+	cpu_set_t cpus;
+	int i;
+
+	if (!rt_prio && rt_cpu < 0)
+		return;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		WARN("Failed to lock memory: %s", strerror(errno));
+
+	if (rt_cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(rt_cpu, &cpus);
+		if ((errno = pthread_setaffinity_np(pthread_self(),
+		  sizeof(cpus), &cpus)))
+			WARN("Failed to pin to CPU %d: %s", rt_cpu,
+			  strerror(errno));
+	}
+
+	if (rt_prio && (errno = pthread_setschedparam(pthread_self(),
+	  SCHED_FIFO, &sp)))
+		WARN("Failed to set SCHED_FIFO priority %d: %s", rt_prio,
+		  strerror(errno));
+
+	/* Touch stack pages, so playback doesn't page fault on them */
+	for (i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+
+	DEBUG("Real-time mode: priority=%d, cpu=%d", rt_prio, rt_cpu);
+}
+
+/*
+ * Beeper state. Only real tone changes are written to device and
+ * waited for: notes of pauses are just skipped, the same tone
+ * isn't set again and a new tone directly replaces the previous
+ * one when there is no gap between notes.
+ */
+struct beeper {
+	struct backend *be;
+	int freq; /* Current tone, 0 -- off */
+};
+
+/* Set beeper tone @freq at absolute time @t */
+static void beeper_set(struct beeper *b, int freq, const struct timespec *t)
+{
+	struct timespec now;
+	long late;
+
+	if (freq == b->freq || sleep_until(t, &stopped))
+		return;
+	backend_tone(b->be, freq);
+	if (timing_out) {
+		late = lateness_usec(t, &now);
+		timing_add(b->be, t, &now, late);
+	}
+	b->freq = freq;
+}
+
+/*
+ * Play compiled melody @loops times (see struct transform). Note
+ * onsets and offsets are absolute deadlines counted from the start
+ * of the melody, so syscall and oversleep latencies don't accumulate
+ * from note to note. Backends with batch op get the whole melody at
+ * once, for every loop.
+ */
+static void play(struct backend *be, const struct note_event *events,
+  int n_events, int loops)
+{
+	struct beeper b = { .be = be };
+	struct timespec t;
+	int i, lap;
+
+	if (backend_has_batch(be)) {
+		for (lap = 0; !stopped && (!lap || lap < loops); lap++) {
+			if (backend_batch(be, events, n_events)) {
+				ERR("Failed to play melody: %s", strerror(errno));
+				break;
+			}
+		}
+		debug_flush();
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (lap = 0; !stopped && (!lap || lap < loops
+	  || loops == TRANSFORM_LOOP_FOREVER); lap++) {
+		for (i = 0; !stopped && i < n_events; i++) {
+			beeper_set(&b, events[i].freq, &t);
+			timespec_add_usec(&t, events[i].duration_usec);
+		}
+	}
+	if (stopped) {
+		backend_tone(be, 0);
+		debug_flush();
+		return;
+	}
+	beeper_set(&b, 0, &t);
+	/* Melody lasts until the end of its last note */
+	sleep_until(&t, &stopped);
+	debug_flush();
+}
+
+/*
+ * Play compiled melody transformed by @xform.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int play_xf(struct backend *be, const struct note_event *events,
+  int n_events)
+{
+	struct note_event *ev;
+
+	if (!xform.semitones && !xform.tempo_pct) {
+		play(be, events, n_events, xform.loops);
+		return 0;
+	}
+	if (transform_events(&xform, &tuning, events, n_events, &ev)) {
+		ERR("Failed to transform melody");
+		return -1;
+	}
+	play(be, ev, n_events, xform.loops);
+	free(ev);
+	return 0;
+}
+
+/*
+ * Melody streamed from file descriptor. Notes are compiled
+ * ahead of playback into a bounded buffer of events.
+ */
+#define STREAM_CHUNK 4096
+#define STREAM_EVENTS 256
+
+struct player_stream {
+	int in;
+	int eof;
+	struct parser parser;
+	struct melody_stream st;
+	int first, last; /* Compiled, but not played yet events */
+	struct note_event ev[STREAM_EVENTS];
+	char buf[STREAM_CHUNK];
+};
+
+/*
+ * Read and compile next chunk of melody. If not @block, then
+ * return at once if there is no input ready.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int stream_fill(struct player_stream *ps, int block)
+{
+	struct pollfd pfd = { .fd = ps->in, .events = POLLIN };
+	int len, n;
+
+	if (ps->eof)
+		return 0;
+	if (!block && poll(&pfd, 1, 0) <= 0)
+		return 0;
+
+	if (ps->first) {
+		memmove(ps->ev, ps->ev + ps->first,
+		  (ps->last - ps->first) * sizeof(ps->ev[0]));
+		ps->last -= ps->first;
+		ps->first = 0;
+	}
+
+	/* Chunk of len bytes compiles to at most 2 * (len + 1) events */
+	len = (STREAM_EVENTS - ps->last) / 2 - 1;
+	if (len > sizeof(ps->buf))
+		len = sizeof(ps->buf);
+	if (len <= 0)
+		return 0;
+
+	len = read(ps->in, ps->buf, len);
+	if (len < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		ERR("Failed to read melody: %s", strerror(errno));
+		return -1;
+	}
+
+	if (!len) {
+		n = stream_end(&ps->st, ps->ev + ps->last);
+		ps->eof = 1;
+	} else {
+		n = stream_feed(&ps->st, ps->buf, len, ps->ev + ps->last);
+		ps->eof = ps->st.state == ST_END;
+	}
+	if (n < 0)
+		return -1;
+	ps->last += n;
+
+	return 0;
+}
+
+/*
+ * Play melody read from @in. First STREAM_EVENTS events are compiled
+ * before playback, the rest is compiled while notes sound.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int play_stream(int in, struct backend *be)
+{
+	struct player_stream *ps;
+	struct beeper b = { .be = be };
+	struct note_event e;
+	struct timespec t, now;
+	int err = -1;
+
+	ps = malloc(sizeof(*ps));
+	if (!ps)
+		return -1;
+	ps->in = in;
+	ps->eof = 0;
+	ps->first = ps->last = 0;
+	melody_parser_init(&ps->parser, NULL, 0);
+	stream_init(&ps->st, &ps->parser);
+
+	/* Until there is no room for a chunk */
+	while (!ps->eof && !stopped && ps->last < STREAM_EVENTS - 3) {
+		if (stream_fill(ps, 1))
+			goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (;;) {
+		if (stopped) {
+			backend_tone(be, 0);
+			err = 0;
+			goto out;
+		}
+		if (ps->first == ps->last) {
+			if (ps->eof)
+				break;
+			/* Input is late, restart schedule after it */
+			if (stream_fill(ps, 1))
+				goto out;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > t.tv_sec || now.tv_sec == t.tv_sec
+			  && now.tv_nsec > t.tv_nsec)
+				t = now;
+			continue;
+		}
+
+		e = ps->ev[ps->first++];
+		transform_note(&xform, &tuning, &e);
+		beeper_set(&b, e.freq, &t);
+		timespec_add_usec(&t, e.duration_usec);
+		/* Compile more notes while this one sounds */
+		if (stream_fill(ps, 0)) {
+			backend_tone(be, 0);
+			goto out;
+		}
+	}
+	beeper_set(&b, 0, &t);
+	sleep_until(&t, &stopped);
+	err = 0;
+
+out:
+	free(ps);
+	debug_flush();
+	return err;
+}
+
+/*
+ * Daemon mode: keep event device open and play melodies submitted
+ * over a Unix domain socket. Every connection carries one request:
+ * struct daemon_req header followed by @len bytes of payload. Daemon
+ * replies with int status: 0 -- melody is queued, <0 -- error. While
+ * melody waits in queue, connection stays open: it is closed when
+ * melody starts, or -ENOBUFS is sent before that if melody is dropped.
+ *
+ * Queue is ordered by priority, melodies of the same priority are
+ * played in order of submission. If queue is full, melody of higher
+ * priority than the last queued one drops that one, otherwise it is
+ * rejected. Melody of higher priority than the
+ * playing one preempts it at the end of the current note or at once
+ * (REQ_F_NOW). Preempted melody is discarded, unless it was submitted
+ * with REQ_F_RESUME: then it goes on from the interrupted note after
+ * melodies of higher priority. Looped melody (struct transform) is
+ * played from one copy of events, a melody looped until stopped is
+ * ended by REQ_STOP.
+ */
+enum daemon_req_types {
+	REQ_RTTTL=1,  /* Payload: RTTTL string (no '\0' needed) */
+	REQ_EVENTS=2, /* Payload: array of struct note_event */
+	REQ_NAME=3,   /* Payload: name of already cached melody */
+	REQ_RING=4,   /* No payload, reply carries memfd and eventfd of ring */
+	REQ_METRICS=5, /* No payload, reply is status and metrics text */
+	REQ_STOP=6,    /* No payload, stop playing melody, it isn't resumed */
+};
+
+enum daemon_req_flags {
+	REQ_F_NOW=1,    /* Preempt lower priority melody at once */
+	REQ_F_RESUME=2, /* Resume this melody, if it is preempted */
+};
+
+struct daemon_req {
+	unsigned int type;
+	unsigned int len; /* Payload length, bytes */
+	int priority;     /* Higher preempts lower, default is 0 */
+	unsigned int flags;
+	struct transform xf; /* Applied to melody before it is queued */
+	int a4_mhz;          /* Tuning of REQ_EVENTS payload */
+};
+
+#define DAEMON_MAX_PAYLOAD (64 * 1024)
+#define DAEMON_MAX_QUEUE 32
+#define DAEMON_MAX_NOTE_USEC (60 * 1000000)
+
+/* Request is replied by its handler */
+#define DAEMON_REPLIED 1
+
+/*
+ * Daemon metrics, queried with REQ_METRICS or dumped to stderr on
+ * SIGUSR1. Compile failures are counted per melody: melody is
+ * rejected at its first invalid note, no note is skipped.
+ */
+#define METRICS_LATE_USEC 1000 /* Write this late misses its deadline */
 
-#include <linux/input.h>
+static struct {
+	unsigned long requests, rejected;
+	unsigned long parse_failed;
+	unsigned long played, preempted, failed;
+	unsigned long events; /* Played events */
+	unsigned long late;   /* Writes which missed deadline */
+	struct histogram parse, queue_wait, first_tone, lateness;
+} metrics = {
+	.parse = { "beep_melody_parse_usec",
+	  "Time to compile melody not found in cache" },
+	.queue_wait = { "beep_melody_queue_wait_usec",
+	  "Time from submit to playback start" },
+	.first_tone = { "beep_melody_first_tone_usec",
+	  "Time from submit to the first tone" },
+	.lateness = { "beep_melody_write_lateness_usec",
+	  "Lateness of tone changes relative to their deadlines" },
+};
+
+/* Melody waiting for playback */
+struct play_item {
+	struct play_item *next;
+	struct note_event *events;
+	int n_events;
+	int first; /* The first event to play, > 0 for resumed melody */
+	int loops; /* Laps left, including the one of @first, >= 1 or
+	              TRANSFORM_LOOP_FOREVER */
+	int resumed;
+	int priority;
+	unsigned int flags;
+	int started; /* The first tone is played */
+	int client;  /* Connection of submitter while melody waits in
+	                queue, -1 -- none */
+	struct timespec submitted;
+	struct voice voice;
+};
+
+/*
+ * Melodies are played one by one on the playback engine: when a
+ * melody ends, its completion callback starts the next one in queue.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t space; /* Queue isn't full any more */
+	struct play_item *head;
+	int len;
+	struct play_item *playing; /* NULL -- beeper is idle */
+	struct play_item *ring;    /* Melody of tone ring, it is extended */
+	struct backend *be;
+	struct backend *retired; /* Replaced, but still played backend */
+	struct engine engine;
+} queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.space = PTHREAD_COND_INITIALIZER,
+};
+
+static int write_full(int fd, const void *buf, size_t len);
+
+/*
+ * Tell client of queued melody @it that the melody has left queue:
+ * close connection if melody is started (@status is 0), send @status
+ * before that otherwise. Queue must be locked.
+ */
+static void queue_reply(struct play_item *it, int status)
+{
+	if (it->client < 0)
+		return;
+	if (status)
+		write_full(it->client, &status, sizeof(status));
+	close(it->client);
+	it->client = -1;
+}
+
+/* Free melody, which has left queue. Queue must be locked */
+static void queue_free(struct play_item *it)
+{
+	queue_reply(it, -EIO);
+	if (it == queue.ring)
+		queue.ring = NULL;
+	free(it->events);
+	free(it);
+}
+
+/*
+ * Return: link to the last queued melody (of the lowest priority), it
+ *   is NULL if queue is empty. Queue must be locked.
+ */
+static struct play_item **queue_tail(void)
+{
+	struct play_item **p = &queue.head;
+
+	while (*p && (*p)->next)
+		p = &(*p)->next;
+	return p;
+}
+
+/*
+ * Drop the last queued melody to make room for melody of @priority,
+ * its client gets -ENOBUFS. Queue must be locked.
+ *
+ * Return: 0 -- Ok, <0 -- no queued melody has lower priority,
+ */
+static int queue_evict(int priority)
+{
+	struct play_item **p = queue_tail(), *it = *p;
+
+	if (!it || it->priority >= priority)
+		return -1;
+	DEBUG("Dropping queued melody of priority %d", it->priority);
+	*p = NULL;
+	queue.len--;
+	queue_reply(it, -ENOBUFS);
+	queue_free(it);
+	return 0;
+}
+
+/*
+ * Insert @it into queue after melodies of the same priority, or
+ * before them if @ahead. Queue must be locked.
+ */
+static void queue_insert(struct play_item *it, int ahead)
+{
+	struct play_item **p = &queue.head;
+
+	while (*p && ((*p)->priority > it->priority
+	  || !ahead && (*p)->priority == it->priority))
+		p = &(*p)->next;
+	it->next = *p;
+	*p = it;
+	queue.len++;
+}
+
+static void queue_done(struct voice *v, int status, void *arg);
+
+/*
+ * Start playback of @it. Queue must be locked.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int queue_start(struct play_item *it)
+{
+	struct timespec now;
+
+	if (!it->resumed) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		hist_add(&metrics.queue_wait, (now.tv_sec - it->submitted.tv_sec)
+		  * 1000000 + (now.tv_nsec - it->submitted.tv_nsec) / 1000);
+	}
+	it->voice.be = queue.be;
+	it->voice.events = it->events;
+	it->voice.n_events = it->n_events;
+	it->voice.first = it->first;
+	it->voice.loops = it->loops;
+	it->voice.done = queue_done;
+	it->voice.arg = it;
+	queue.playing = it;
+	if (engine_submit(&queue.engine, &it->voice, NULL)) {
+		ERR("Failed to start playback: %s", strerror(errno));
+		queue.playing = NULL;
+		return -1;
+	}
+	queue_reply(it, 0);
+	return 0;
+}
+
+/* Called by engine thread at the end of melody */
+static void queue_done(struct voice *v, int status, void *arg)
+{
+	struct play_item *it = arg;
+	int lap = v->resume_lap, first = v->resume;
+
+	if (status && status != -ECANCELED)
+		WARN("Playback failed: %s", strerror(-status));
+	timing_print();
+	debug_flush();
+	counter_add(!status ? &metrics.played : status == -ECANCELED
+	  ? &metrics.preempted : &metrics.failed, 1);
+	counter_add(&metrics.events, (unsigned long)lap * it->n_events + first
+	  - it->first);
+
+	if (first == it->n_events) {
+		first = 0;
+		lap++;
+	}
+	pthread_mutex_lock(&queue.lock);
+	queue.playing = NULL;
+	if (status == -ECANCELED && it->flags & REQ_F_RESUME
+	  && (it->loops == TRANSFORM_LOOP_FOREVER || lap < it->loops)) {
+		DEBUG("Melody preempted at event #%d, it will resume",
+		  first + 1);
+		it->first = first;
+		if (it->loops != TRANSFORM_LOOP_FOREVER)
+			it->loops -= lap;
+		it->resumed = 1;
+		queue_insert(it, 1);
+	} else {
+		if (status == -ECANCELED)
+			DEBUG("Melody preempted, discarded");
+		queue_free(it);
+	}
+	if (queue.retired) {
+		backend_close(queue.retired);
+		free(queue.retired);
+		queue.retired = NULL;
+	}
+	while (!queue.playing && (it = queue.head)) {
+		queue.head = it->next;
+		queue.len--;
+		if (queue_start(it))
+			queue_free(it);
+	}
+	pthread_cond_broadcast(&queue.space);
+	pthread_mutex_unlock(&queue.lock);
+}
+
+/*
+ * Start or queue melody @it, preempting the playing one if it has
+ * lower priority. If queue is full, the last queued melody is dropped
+ * for @it of higher priority.
+ *
+ * Return: 0 -- Ok, <0 -- queue is full or error,
+ */
+static int queue_add(struct play_item *it)
+{
+	clock_gettime(CLOCK_MONOTONIC, &it->submitted);
+	if (!queue.playing)
+		return queue_start(it);
+	if (queue.len >= DAEMON_MAX_QUEUE && queue_evict(it->priority))
+		return -1;
+	queue_insert(it, 0);
+	if (it->priority > queue.playing->priority) {
+		DEBUG("Preempting melody of priority %d",
+		  queue.playing->priority);
+		engine_stop(&queue.engine, &queue.playing->voice,
+		  it->flags & REQ_F_NOW ? VOICE_STOP_NOW : VOICE_STOP_NOTE);
+	}
+	return 0;
+}
+
+/*
+ * Queue melody played @loops times (see struct transform), see enum
+ * daemon_req_flags for @flags. Client on connection @c is replied 0,
+ * if melody waits in queue, the connection is kept until melody
+ * starts (see struct daemon_req).
+ *
+ * Return: 0 -- Ok, <0 -- queue is full,
+ */
+static int queue_push(struct note_event *events, int n_events, int loops,
+  int priority, unsigned int flags, int c)
+{
+	struct play_item *it;
+	int err, status = 0;
+
+	it = calloc(1, sizeof(*it));
+	if (!it)
+		return -1;
+	it->events = events;
+	it->n_events = n_events;
+	it->loops = loops ? loops : 1;
+	it->priority = priority;
+	it->flags = flags;
+	it->client = -1;
+
+	pthread_mutex_lock(&queue.lock);
+	err = queue_add(it);
+	if (!err) {
+		write_full(c, &status, sizeof(status));
+		if (it != queue.playing
+		  && (it->client = fcntl(c, F_DUPFD_CLOEXEC, 0)) < 0)
+			WARN("Failed to keep client connection: %s",
+			  strerror(errno));
+	}
+	pthread_mutex_unlock(&queue.lock);
+	if (err)
+		free(it);
+
+	return err;
+}
+
+/*
+ * Replace backend of daemon with @be. Backend of melody being played
+ * is closed when the melody ends.
+ */
+static void queue_set_backend(struct backend *be)
+{
+	struct backend *old;
+
+	pthread_mutex_lock(&queue.lock);
+	old = queue.be;
+	queue.be = be;
+	if (queue.playing && queue.playing->voice.be == old) {
+		queue.retired = old;
+		old = NULL;
+	}
+	pthread_mutex_unlock(&queue.lock);
+
+	if (old) {
+		backend_close(old);
+		free(old);
+	}
+}
+
+/* Called by engine thread after every tone change */
+static void timing_hook(struct voice *v, const struct timespec *deadline)
+{
+	struct play_item *it = v->arg;
+	struct timespec now;
+	long late;
+
+	if (!it->started) {
+		it->started = 1;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timing.start_latency = (now.tv_sec - it->submitted.tv_sec)
+		  * 1000000 + (now.tv_nsec - it->submitted.tv_nsec) / 1000;
+		hist_add(&metrics.first_tone, timing.start_latency);
+		DEBUG("First tone %ld usec after submit", timing.start_latency);
+	}
+	late = lateness_usec(deadline, &now);
+	hist_add(&metrics.lateness, late);
+	if (late > METRICS_LATE_USEC)
+		counter_add(&metrics.late, 1);
+	if (timing_out)
+		timing_add(v->be, deadline, &now, late);
+}
+
+static void *player_thread(void *arg)
+{
+	rt_setup();
+	engine_run(&queue.engine);
+	ERR("Playback engine failed: %s", strerror(errno));
+	exit(1);
+
+	return NULL;
+}
+
+/* Return: 0 -- Ok, <0 -- error or EOF */
+static int read_full(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Tone of client is played only if all backends support it: they
+ * divide by frequency, so it is limited from above too.
+ */
+static inline int tone_valid(int freq, int duration_usec)
+{
+	return freq >= 0 && freq <= TONE_MAX_HZ && duration_usec > 0
+	  && duration_usec <= DAEMON_MAX_NOTE_USEC;
+}
+
+/* Return: 0 -- Ok, <0 -- invalid events */
+static int check_events(const struct note_event *events, int n_events)
+{
+	int i;
+
+	for (i = 0; i < n_events; i++) {
+		if (!tone_valid(events[i].freq, events[i].duration_usec)) {
+			WARN("Event #%d: invalid freq or duration", i + 1);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Cache of compiled melodies. Key is a hash of the whole melody
+ * string, melody name can be used for lookup too. Cache is used
+ * only from the daemon accept loop, so it needs no locking.
+ */
+#define CACHE_SIZE 64
+
+struct cache_entry {
+	unsigned long long hash;
+	char name[MELODY_MAX_NAME]; /* "" -- unnamed melody */
+	char *melody;              /* NULL -- free entry */
+	struct note_event *events;
+	int n_events;
+	unsigned long last_use;
+};
+
+static struct {
+	struct cache_entry e[CACHE_SIZE];
+	unsigned long clock;
+	unsigned long hits, misses;
+} cache;
+
+/* FNV-1a */
+static unsigned long long melody_hash(const char *s)
+{
+	unsigned long long h = 14695981039346656037ULL;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static struct note_event *dup_events(const struct note_event *events,
+  int n_events)
+{
+	struct note_event *ev;
+
+	ev = malloc(n_events * sizeof(*ev) + 1); /* +1: empty melody is Ok */
+	if (ev)
+		memcpy(ev, events, n_events * sizeof(*ev));
+	return ev;
+}
+
+/* Find cached melody by @melody string or, if it is NULL, by @name */
+static struct cache_entry *cache_find(const char *melody, const char *name)
+{
+	unsigned long long h = melody ? melody_hash(melody) : 0;
+	struct cache_entry *e;
+
+	for (e = cache.e; e < cache.e + CACHE_SIZE; e++) {
+		if (!e->melody)
+			continue;
+		if (melody ? e->hash == h && !strcmp(e->melody, melody)
+		  : *name && !strcmp(e->name, name)) {
+			e->last_use = ++cache.clock;
+			counter_add(&cache.hits, 1);
+			return e;
+		}
+	}
+	counter_add(&cache.misses, 1);
+	return NULL;
+}
+
+static void cache_free_entry(struct cache_entry *e)
+{
+	free(e->melody);
+	free(e->events);
+	e->melody = NULL;
+	e->events = NULL;
+}
+
+/*
+ * Add compiled melody to cache, evict least recently used entry
+ * if cache is full. Cached melody with the same name is replaced.
+ * Cache takes ownership of @melody and copies @events.
+ */
+static void cache_add(char *melody, const struct note_event *events,
+  int n_events)
+{
+	struct cache_entry *e, *victim = NULL;
+	char name[MELODY_MAX_NAME];
+
+	melody_name(melody, strlen(melody), name);
+	for (e = cache.e; e < cache.e + CACHE_SIZE; e++) {
+		if (e->melody && *name && !strcmp(e->name, name)) {
+			victim = e;
+			break;
+		}
+		if (!victim || !e->melody
+		  || victim->melody && e->last_use < victim->last_use)
+			victim = e;
+	}
+
+	cache_free_entry(victim);
+	victim->events = dup_events(events, n_events);
+	if (!victim->events) {
+		free(melody);
+		return;
+	}
+	victim->melody = melody;
+	victim->hash = melody_hash(melody);
+	strcpy(victim->name, name);
+	victim->n_events = n_events;
+	victim->last_use = ++cache.clock;
+	DEBUG("Cached melody \"%s\"", name);
+}
+
+/*
+ * Tones submitted through shared memory ring (see ring.h). The ring
+ * is created on the first REQ_RING request and shared by all clients.
+ * Consumer thread appends records to the ring melody (queue.ring),
+ * while it has the same priority and isn't over, so they are played
+ * on one schedule, as a stream. Otherwise a record starts the next
+ * ring melody. While the queue is full, this record waits in the
+ * consumer and the rest are left in the ring, so producers see it
+ * full.
+ */
+#define RING_MELODY_EVENTS 4096
+#define RING_RETRY_USEC (10 * 1000)
+
+static struct {
+	pthread_mutex_t lock;
+	struct tone_ring r;
+	int ready;
+} ring = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * Append @ev to the ring melody of @priority. Queue must be locked.
+ *
+ * Return: 0 -- Ok, <0 -- there is no such melody or it is over,
+ */
+static int ring_append(const struct note_event *ev, int priority)
+{
+	struct play_item *it = queue.ring;
+
+	if (!it || it->priority != priority
+	  || it->n_events == RING_MELODY_EVENTS)
+		return -1;
+	it->events[it->n_events] = *ev;
+	if (it == queue.playing && engine_append(&queue.engine, &it->voice,
+	  it->n_events + 1))
+		return -1;
+	it->n_events++;
+	return 0;
+}
+
+/*
+ * Start the next ring melody with @ev. Queue must be locked, it
+ * is unlocked while waiting for room in queue.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int ring_start(const struct note_event *ev, int priority)
+{
+	struct play_item *it;
+
+	if (!(it = calloc(1, sizeof(*it))))
+		return -1;
+	if (!(it->events = malloc(RING_MELODY_EVENTS * sizeof(*ev)))) {
+		free(it);
+		return -1;
+	}
+	it->events[0] = *ev;
+	it->n_events = 1;
+	it->loops = 1;
+	it->priority = priority;
+	it->client = -1;
+
+	while (queue.playing && queue.len >= DAEMON_MAX_QUEUE
+	  && (*queue_tail())->priority >= priority)
+		pthread_cond_wait(&queue.space, &queue.lock);
+	if (queue_add(it)) {
+		free(it->events);
+		free(it);
+		return -1;
+	}
+	DEBUG("Ring melody of priority %d", priority);
+	queue.ring = it;
+	return 0;
+}
+
+static void *ring_thread(void *arg)
+{
+	struct note_event ev;
+	struct tone_rec rec;
+
+	for (;;) {
+		if (!ring_pop(&ring.r, &rec)) {
+			if (ring_wait(&ring.r)) {
+				ERR("Failed to wait for tones: %s",
+				  strerror(errno));
+				break;
+			}
+			continue;
+		}
+		if (!tone_valid(rec.freq, rec.duration_usec)) {
+			WARN("Invalid tone record: freq=%d, duration=%d",
+			  rec.freq, rec.duration_usec);
+			continue;
+		}
+		ev.freq = rec.freq;
+		ev.duration_usec = rec.duration_usec;
+
+		pthread_mutex_lock(&queue.lock);
+		while (ring_append(&ev, rec.priority)
+		  && ring_start(&ev, rec.priority)) {
+			/* Out of memory or playback error, try again later */
+			pthread_mutex_unlock(&queue.lock);
+			usleep(RING_RETRY_USEC);
+			pthread_mutex_lock(&queue.lock);
+		}
+		pthread_mutex_unlock(&queue.lock);
+	}
+
+	return NULL;
+}
+
+/* Send @status with file descriptors @fds */
+static int send_fds(int c, int status, const int *fds, int n)
+{
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { .iov_base = &status, .iov_len = sizeof(status) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = CMSG_SPACE(n * sizeof(int)),
+	};
+	struct cmsghdr *cm;
+
+	memset(cbuf, 0, sizeof(cbuf));
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, n * sizeof(int));
+	return sendmsg(c, &msg, MSG_NOSIGNAL) == sizeof(status) ? 0 : -1;
+}
+
+/* Return: 0 -- Ok, <0 -- error or EOF */
+static int recv_fds(int s, int *status, int *fds, int n)
+{
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct iovec iov = { .iov_base = status, .iov_len = sizeof(*status) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = CMSG_SPACE(n * sizeof(int)),
+	};
+	struct cmsghdr *cm;
+
+	if (recvmsg(s, &msg, MSG_CMSG_CLOEXEC) != sizeof(*status))
+		return -1;
+	cm = CMSG_FIRSTHDR(&msg);
+	if (*status || !cm || cm->cmsg_type != SCM_RIGHTS
+	  || cm->cmsg_len != CMSG_LEN(n * sizeof(int)))
+		return -1;
+	memcpy(fds, CMSG_DATA(cm), n * sizeof(int));
+	return 0;
+}
+
+/* Reply to REQ_RING: send ring to client, create it if needed */
+static int daemon_ring(int c)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	int fds[2], status = -1;
+
+	pthread_mutex_lock(&ring.lock);
+	if (!ring.ready) {
+		if (ring_create(&ring.r)) {
+			ERR("Failed to create tone ring: %s", strerror(errno));
+			goto out;
+		}
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		errno = pthread_create(&tid, &attr, ring_thread, NULL);
+		pthread_attr_destroy(&attr);
+		if (errno) {
+			ERR("Failed to create ring thread: %s", strerror(errno));
+			ring_close(&ring.r);
+			goto out;
+		}
+		ring.ready = 1;
+	}
+	status = 0;
+
+out:
+	pthread_mutex_unlock(&ring.lock);
+	if (status) {
+		write_full(c, &status, sizeof(status));
+		return DAEMON_REPLIED;
+	}
+	fds[0] = ring.r.memfd;
+	fds[1] = ring.r.efd;
+	if (send_fds(c, 0, fds, 2))
+		WARN("Failed to send tone ring: %s", strerror(errno));
+	return DAEMON_REPLIED;
+}
+
+/* Print daemon metrics in Prometheus text format */
+static void metrics_print(FILE *f)
+{
+	unsigned long hits = counter_get(&cache.hits);
+	unsigned long misses = counter_get(&cache.misses);
+	int len;
+
+	pthread_mutex_lock(&queue.lock);
+	len = queue.len;
+	pthread_mutex_unlock(&queue.lock);
+
+	flockfile(f);
+	metrics_print_value(f, "beep_melody_requests_total", "counter",
+	  "Requests to daemon", counter_get(&metrics.requests));
+	metrics_print_value(f, "beep_melody_requests_rejected_total", "counter",
+	  "Requests replied with error", counter_get(&metrics.rejected));
+	metrics_print_value(f, "beep_melody_parse_failed_total", "counter",
+	  "Melodies rejected by compiler", counter_get(&metrics.parse_failed));
+	metrics_print_value(f, "beep_melody_melodies_played_total", "counter",
+	  "Melodies played to the end", counter_get(&metrics.played));
+	metrics_print_value(f, "beep_melody_melodies_preempted_total",
+	  "counter", "Melodies stopped by melodies of higher priority",
+	  counter_get(&metrics.preempted));
+	metrics_print_value(f, "beep_melody_melodies_failed_total", "counter",
+	  "Melodies stopped by backend error", counter_get(&metrics.failed));
+	metrics_print_value(f, "beep_melody_events_played_total", "counter",
+	  "Note events played", counter_get(&metrics.events));
+	metrics_print_value(f, "beep_melody_deadline_misses_total", "counter",
+	  "Tone changes late by more than 1000 usec",
+	  counter_get(&metrics.late));
+	metrics_print_value(f, "beep_melody_cache_hits_total", "counter",
+	  "Melodies found in cache", hits);
+	metrics_print_value(f, "beep_melody_cache_misses_total", "counter",
+	  "Melodies not found in cache", misses);
+	metrics_print_value(f, "beep_melody_cache_hit_ratio", "gauge",
+	  "Cache hits of all lookups", hits + misses
+	  ? (double)hits / (hits + misses) : 0);
+	metrics_print_value(f, "beep_melody_queue_length", "gauge",
+	  "Melodies waiting for playback", len);
+	metrics_print_hist(f, &metrics.parse);
+	metrics_print_hist(f, &metrics.queue_wait);
+	metrics_print_hist(f, &metrics.first_tone);
+	metrics_print_hist(f, &metrics.lateness);
+	fflush(f);
+	funlockfile(f);
+}
+
+/* Reply to REQ_METRICS: status and metrics text */
+static int daemon_metrics(int c)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	int status = 0;
+	FILE *f;
+
+	if (!(f = open_memstream(&buf, &size)))
+		return -1;
+	metrics_print(f);
+	fclose(f);
+	if (write_full(c, &status, sizeof(status))
+	  || write_full(c, buf, size))
+		WARN("Failed to send metrics");
+	free(buf);
+	return DAEMON_REPLIED;
+}
+
+/* Handle REQ_STOP: stop playing melody at once, don't resume it */
+static int daemon_stop(void)
+{
+	pthread_mutex_lock(&queue.lock);
+	if (queue.playing) {
+		DEBUG("Stopping melody of priority %d",
+		  queue.playing->priority);
+		queue.playing->flags &= ~REQ_F_RESUME;
+		engine_stop(&queue.engine, &queue.playing->voice,
+		  VOICE_STOP_NOW);
+	}
+	pthread_mutex_unlock(&queue.lock);
+	return 0;
+}
+
+/* Dump metrics to stderr on SIGUSR1, which is blocked in other threads */
+static void *metrics_thread(void *arg)
+{
+	sigset_t *set = arg;
+	int sig;
+
+	while (!sigwait(set, &sig))
+		metrics_print(stderr);
+	return NULL;
+}
+
+/*
+ * Read request from client, compile and queue melody. Melodies
+ * requested by name are looked up in cache and then in @bin.
+ *
+ * Return: 0 -- Ok, <0 -- error, DAEMON_REPLIED -- reply is sent,
+ */
+static int daemon_request(int c, const struct melody_bin *bin)
+{
+	const struct melody_bin_index *bi;
+	struct daemon_req req;
+	struct note_event *events = NULL, *ev;
+	struct cache_entry *ce = NULL;
+	const struct tuning *tn = &tuning;
+	struct tuning events_tuning;
+	struct parser ps;
+	struct timespec t0, t1;
+	char *payload;
+	int n_events;
+
+	if (read_full(c, &req, sizeof(req))) {
+		WARN("Failed to read request header");
+		return -1;
+	}
+	counter_add(&metrics.requests, 1);
+	if (req.len > DAEMON_MAX_PAYLOAD) {
+		WARN("Too long request: %u bytes", req.len);
+		return -1;
+	}
+	payload = malloc(req.len + 1);
+	if (!payload)
+		return -1;
+	if (read_full(c, payload, req.len)) {
+		WARN("Failed to read request payload");
+		free(payload);
+		return -1;
+	}
+
+	switch (req.type) {
+	case REQ_RTTTL:
+		payload[req.len] = '\0';
+		DEBUG("Request: %s", payload);
+		if ((ce = cache_find(payload, NULL))) {
+			free(payload);
+			break;
+		}
+		melody_parser_init(&ps, NULL, 0);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (compile(&ps, payload, &events, &n_events)) {
+			counter_add(&metrics.parse_failed, 1);
+			free(payload);
+			events = NULL;
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		hist_add(&metrics.parse, (t1.tv_sec - t0.tv_sec) * 1000000
+		  + (t1.tv_nsec - t0.tv_nsec) / 1000);
+		cache_add(payload, events, n_events);
+		break;
+	case REQ_NAME:
+		payload[req.len] = '\0';
+		DEBUG("Request: melody \"%s\"", payload);
+		if ((ce = cache_find(NULL, payload))) {
+		} else if (bin && (bi = melody_bin_find(bin, payload))) {
+			n_events = bi->n_events;
+			events = dup_events(bin->events + bi->first, n_events);
+		} else {
+			WARN("Unknown melody \"%s\"", payload);
+		}
+		free(payload);
+		break;
+	case REQ_EVENTS:
+		events = (struct note_event *)payload;
+		n_events = req.len / sizeof(*events);
+		if (req.len % sizeof(*events)
+		  || check_events(events, n_events)) {
+			WARN("Invalid events array");
+			free(events);
+			events = NULL;
+		}
+		/* Transposed by the table of client */
+		if (req.a4_mhz != tuning.a4_mhz
+		  && !tuning_init(&events_tuning, req.a4_mhz))
+			tn = &events_tuning;
+		break;
+	case REQ_RING:
+		free(payload);
+		return daemon_ring(c);
+	case REQ_METRICS:
+		free(payload);
+		return daemon_metrics(c);
+	case REQ_STOP:
+		free(payload);
+		return daemon_stop();
+	default:
+		WARN("Unknown request type %u", req.type);
+		free(payload);
+		break;
+	}
+
+	DEBUG("Cache: hits=%lu, misses=%lu", cache.hits, cache.misses);
+
+	if (ce) {
+		n_events = ce->n_events;
+		events = dup_events(ce->events, n_events);
+	}
+	if (!events)
+		return -1;
+
+	if (transform_check(&req.xf)) {
+		WARN("Invalid melody transformation");
+		free(events);
+		return -1;
+	}
+	if (req.xf.semitones || req.xf.tempo_pct) {
+		ev = NULL;
+		if (transform_events(&req.xf, tn, events, n_events, &ev)
+		  || check_events(ev, n_events)) {
+			WARN("Invalid melody transformation");
+			free(events);
+			free(ev);
+			return -1;
+		}
+		free(events);
+		events = ev;
+	}
+
+	if (queue_push(events, n_events, req.xf.loops, req.priority,
+	  req.flags, c)) {
+		WARN("Playback queue is full");
+		free(events);
+		return -1;
+	}
+
+	return DAEMON_REPLIED;
+}
+
+static int daemon_socket(const char *path, struct sockaddr_un *addr)
+{
+	int s;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		ERR("Too long socket path \"%s\"", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		ERR("Failed to create socket: %s", strerror(errno));
+		return -1;
+	}
+	return s;
+}
+
+static int open_backend(struct backend *be, const char *spec,
+  const char *devices, int refresh);
+
+/* Time for udev to finish with new device nodes */
+#define HOTPLUG_SETTLE_USEC (200 * 1000)
+
+/* Reopen event devices @arg, when devices in /dev/input change */
+static void *hotplug_thread(void *arg)
+{
+	const char *devices = arg;
+	struct pollfd pfd = { .events = POLLIN };
+	char buf[4096];
+	struct backend *be;
+
+	if ((pfd.fd = inotify_init1(IN_CLOEXEC)) < 0
+	  || inotify_add_watch(pfd.fd, DISCOVER_DIR,
+	  IN_CREATE | IN_DELETE | IN_ATTRIB) < 0) {
+		WARN("Failed to watch \"%s\", hotplug is off: %s",
+		  DISCOVER_DIR, strerror(errno));
+		return NULL;
+	}
+
+	for (;;) {
+		if (read(pfd.fd, buf, sizeof(buf)) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		/* Merge burst of events of one hotplug */
+		do {
+			usleep(HOTPLUG_SETTLE_USEC);
+		} while (poll(&pfd, 1, 0) > 0 && read(pfd.fd, buf, sizeof(buf)));
+
+		DEBUG("Event devices changed, reopening \"%s\"", devices);
+		if (!(be = malloc(sizeof(*be))))
+			continue;
+		/* Beepers may have changed w/o change of /dev/input */
+		if (open_backend(be, NULL, devices, 1)) {
+			/* Keep old devices, they may come back */
+			free(be);
+			continue;
+		}
+		queue_set_backend(be);
+	}
+
+	WARN("Failed to read hotplug events: %s", strerror(errno));
+	close(pfd.fd);
+	return NULL;
+}
+
+/*
+ * Run daemon playing on @be. If @devices is set, then @be are
+ * these event devices, they are reopened on hotplug.
+ *
+ * Return: <0 -- error,
+ */
+static int run_daemon(struct backend *be, const char *devices,
+  const char *path, const struct melody_bin *bin)
+{
+	struct sockaddr_un addr;
+	struct timeval tv = { .tv_sec = 1 };
+	static sigset_t sigs;
+	pthread_t tid;
+	int s, c, status;
+
+	if ((s = daemon_socket(path, &addr)) < 0)
+		return -1;
+
+	/* Remove stale socket left by previous daemon */
+	unlink(path);
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr))
+	  || listen(s, 16)) {
+		ERR("Failed to listen on \"%s\": %s", path, strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Threads created from now on inherit blocked SIGUSR1 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	if ((errno = pthread_create(&tid, NULL, metrics_thread, &sigs)))
+		WARN("Failed to create metrics thread: %s", strerror(errno));
+
+	if (engine_init(&queue.engine)) {
+		ERR("Failed to create playback engine: %s", strerror(errno));
+		close(s);
+		return -1;
+	}
+	queue.engine.on_write = timing_hook;
+	if (!(queue.be = malloc(sizeof(*queue.be)))) {
+		close(s);
+		return -1;
+	}
+	*queue.be = *be;
+
+	if ((errno = pthread_create(&tid, NULL, player_thread, NULL))) {
+		ERR("Failed to create player thread: %s", strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	if (devices && (errno = pthread_create(&tid, NULL, hotplug_thread,
+	  (void *)devices)))
+		WARN("Failed to create hotplug thread: %s", strerror(errno));
+
+	for (;;) {
+		if ((c = accept(s, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			ERR("Failed to accept connection: %s", strerror(errno));
+			break;
+		}
+		/* Don't let a stuck client block others */
+		setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		status = daemon_request(c, bin);
+		if (status < 0)
+			counter_add(&metrics.rejected, 1);
+		if (status != DAEMON_REPLIED)
+			write_full(c, &status, sizeof(status));
+		close(c);
+	}
+
+	close(s);
+	return -1;
+}
+
+/*
+ * Submit tones read from stdin as HZ:ms tuples (see beep -s) to daemon
+ * on socket @path through shared memory ring.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int run_ring_client(const char *path, int priority)
+{
+	struct sockaddr_un addr;
+	struct daemon_req req = { .type = REQ_RING, .priority = priority };
+	struct tone_ring r;
+	struct tone_rec rec = { .priority = priority };
+	int s, n, ms, status, fds[2];
+
+	if ((s = daemon_socket(path, &addr)) < 0)
+		return -1;
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr))) {
+		ERR("Failed to connect to daemon \"%s\": %s", path,
+		  strerror(errno));
+		close(s);
+		return -1;
+	}
+	if (write_full(s, &req, sizeof(req))
+	  || recv_fds(s, &status, fds, 2)) {
+		ERR("Daemon didn't give tone ring");
+		close(s);
+		return -1;
+	}
+	close(s);
+	if (ring_attach(&r, fds[0], fds[1])) {
+		ERR("Failed to attach tone ring: %s", strerror(errno));
+		return -1;
+	}
+
+	for (;;) {
+		if (scanf("%*[ \t\r\n,]") == EOF)
+			break;
+		if ((n = scanf("%d:%d", &rec.freq, &ms)) == EOF)
+			break;
+		if (n != 2 || rec.freq < 0 || rec.freq > TONE_MAX_HZ || ms <= 0) {
+			ERR("Invalid tone, expected HZ:ms (HZ 0-%d)", TONE_MAX_HZ);
+			ring_close(&r);
+			return -1;
+		}
+		rec.duration_usec = ms * 1000;
+		while (ring_push(&r, &rec))
+			usleep(RING_RETRY_USEC);
+	}
+
+	ring_close(&r);
+	return 0;
+}
+
+/*
+ * Print metrics of daemon on socket @path to stdout.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int run_metrics_client(const char *path)
+{
+	struct sockaddr_un addr;
+	struct daemon_req req = { .type = REQ_METRICS };
+	char buf[4096];
+	int s, status = -1;
+	ssize_t n;
+
+	if ((s = daemon_socket(path, &addr)) < 0)
+		return -1;
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr))) {
+		ERR("Failed to connect to daemon \"%s\": %s", path,
+		  strerror(errno));
+		close(s);
+		return -1;
+	}
+	if (write_full(s, &req, sizeof(req))
+	  || read_full(s, &status, sizeof(status)) || status) {
+		ERR("Daemon didn't give metrics");
+		close(s);
+		return -1;
+	}
+	while ((n = read(s, buf, sizeof(buf))) > 0 || n < 0 && errno == EINTR) {
+		if (n > 0 && fwrite(buf, 1, n, stdout) != n)
+			break;
+	}
+	close(s);
+	return n ? -1 : 0;
+}
+
+/*
+ * Stop melody playing by daemon on socket @path.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int run_stop_client(const char *path)
+{
+	struct sockaddr_un addr;
+	struct daemon_req req = { .type = REQ_STOP };
+	int s, status = -1;
+
+	if ((s = daemon_socket(path, &addr)) < 0)
+		return -1;
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr))) {
+		ERR("Failed to connect to daemon \"%s\": %s", path,
+		  strerror(errno));
+		close(s);
+		return -1;
+	}
+	if (write_full(s, &req, sizeof(req))
+	  || read_full(s, &status, sizeof(status)) || status) {
+		ERR("Daemon didn't stop melody");
+		status = -1;
+	}
+	close(s);
+	return status;
+}
+
+/*
+ * Submit melody to daemon. With @precompile the melody is compiled
+ * here and the daemon gets a ready events array. If @name is set,
+ * then ask daemon to play already cached melody with this name.
+ */
+static int run_client(const char *path, const char *melody,
+  const char *name, int precompile, int priority, unsigned int flags)
+{
+	struct sockaddr_un addr;
+	struct daemon_req req;
+	struct note_event *events = NULL;
+	struct parser ps;
+	const void *payload;
+	int s = -1, n_events, status = -1;
+
+	req.priority = priority;
+	req.flags = flags;
+	req.xf = xform;
+	req.a4_mhz = tuning.a4_mhz;
+	if (name) {
+		req.type = REQ_NAME;
+		req.len = strlen(name);
+		payload = name;
+	} else if (precompile) {
+		melody_parser_init(&ps, NULL, 0);
+		if (compile(&ps, melody, &events, &n_events))
+			return -1;
+		req.type = REQ_EVENTS;
+		req.len = n_events * sizeof(*events);
+		payload = events;
+	} else {
+		req.type = REQ_RTTTL;
+		req.len = strlen(melody);
+		payload = melody;
+	}
+
+	if ((s = daemon_socket(path, &addr)) < 0)
+		goto out;
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr))) {
+		ERR("Failed to connect to daemon \"%s\": %s", path,
+		  strerror(errno));
+		goto out;
+	}
+
+	if (write_full(s, &req, sizeof(req))
+	  || write_full(s, payload, req.len)
+	  || read_full(s, &status, sizeof(status))) {
+		ERR("Failed to submit melody to daemon");
+		status = -1;
+		goto out;
+	}
+	if (status) {
+		ERR("Daemon rejected melody");
+		goto out;
+	}
+	/* Wait for melody to leave queue, EOF -- it is started */
+	if (!read_full(s, &status, sizeof(status)) && status) {
+		ERR("Melody is dropped from daemon queue: %s",
+		  strerror(-status));
+		status = -1;
+	} else {
+		status = 0;
+	}
+
+out:
+	if (s >= 0)
+		close(s);
+	free(events);
+	return status;
+}
+
+/*
+ * Batch mode: compile every melody of a library file, one melody
+ * per line, optionally in double quotes (like beep_melody.txt).
+ * Empty lines are skipped.
+ */
+struct library_entry {
+	int line;
+	char name[MELODY_MAX_NAME];
+	const char *melody;        /* Points to library data */
+	int len;
+	int valid;
+	struct note_event *events; /* Only if library keeps events */
+	int n_events;
+	int n_notes;               /* Without articulation pauses */
+	char err[256];             /* Compile errors */
+};
+
+struct library {
+	const char *data; /* Library file contents */
+	size_t size;
+	int mapped;       /* Data is mmap'ed */
+	struct library_entry *e;
+	int n;
+	int n_invalid;
+	long n_notes;
+	int keep_events; /* Don't free events after compiling */
+	int next;        /* Next entry to compile (shared by workers) */
+};
+
+/* Read whole file to '\0'-terminated buffer (caller must free it) */
+static char *read_file(const char *path, size_t *size)
+{
+	char *buf = NULL, *p;
+	size_t len = 0, alloc = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		ERR("Failed to open \"%s\": %s", path, strerror(errno));
+		return NULL;
+	}
+	for (;;) {
+		if (alloc - len < STREAM_CHUNK + 1) {
+			alloc = alloc ? alloc * 2 : 2 * STREAM_CHUNK;
+			if (!(p = realloc(buf, alloc))) {
+				ERR("Failed to allocate %zu bytes", alloc);
+				goto err;
+			}
+			buf = p;
+		}
+		n = read(fd, buf + len, alloc - len - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			ERR("Failed to read \"%s\": %s", path, strerror(errno));
+			goto err;
+		}
+		if (!n)
+			break;
+		len += n;
+	}
+	close(fd);
+	buf[len] = '\0';
+	*size = len;
+	return buf;
 
-/* Default values */
-static int octave;   /* Possible values: 4-7 */
-static int duration; /* Possible values: 1, 2, 4, 8, 16, 32 */
-static int tempo;    /* Possible values: 40-200 */
-static int whole_note_ms;
+err:
+	close(fd);
+	free(buf);
+	return NULL;
+}
 
-static int debug;
+/*
+ * Map file to memory. Files which can't be mapped (e.g. pipes)
+ * are read to buffer.
+ *
+ * Out: @size, @mapped -- 1: file is mapped (unmap it with munmap()),
+ *   0: file is read to buffer (free it with free()),
+ */
+static const char *map_file(const char *path, size_t *size, int *mapped)
+{
+	struct stat st;
+	void *p;
+	int fd;
 
-enum log_levels {
-	LOG_DBG=0,
-	LOG_INFO=1,
-	LOG_WARN=2,
-	LOG_ERR=9,
-};
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		ERR("Failed to open \"%s\": %s", path, strerror(errno));
+		return NULL;
+	}
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			close(fd);
+			madvise(p, st.st_size, MADV_SEQUENTIAL);
+			*size = st.st_size;
+			*mapped = 1;
+			return p;
+		}
+	}
+	close(fd);
 
-#define DEBUG(frmt, ...) _log(LOG_DBG, frmt, ##__VA_ARGS__)
-#define WARN(frmt, ...)  _log(LOG_WARN, frmt, ##__VA_ARGS__)
-#define ERR(frmt, ...)   _log(LOG_ERR, frmt, ##__VA_ARGS__)
+	*mapped = 0;
+	return read_file(path, size);
+}
 
-static void _log(int level, const char *frmt, ...)
+static void free_library(struct library *lib)
 {
-	static const char *l[] = {
-		[LOG_DBG] = "DEBUG",
-		[LOG_INFO] = "INFO",
-		[LOG_WARN] = "WARNING",
-		[LOG_ERR] = "ERROR",
-	};
-	va_list args;
-
-	if (!debug && level == LOG_DBG)
-		return;
+	int i;
 
-	va_start(args, frmt);
-	fprintf(stderr, "%s: ", l[level]);
-	vfprintf(stderr, frmt, args);
-	fprintf(stderr, "\n");
-	va_end(args);
+	for (i = 0; i < lib->n; i++)
+		free(lib->e[i].events);
+	free(lib->e);
+	if (lib->mapped)
+		munmap((void *)lib->data, lib->size);
+	else
+		free((void *)lib->data);
 }
 
 /*
- * In: @ni -- note index (for error messages), @s -- note string
- *   in format: "[<duration>][CDEFGABP][#][.][<octave>]",
- * Out: @freq, @duration_usec,
+ * Map library @path and split it to melodies. Melodies are not
+ * copied, entries point to the mapped file.
+ *
  * Return: 0 -- Ok, <0 -- error,
  */
-static int parse_note(int ni, const char *s, int *freq, int *duration_usec)
-{
-	const char *p = s;
-	int c, note, sharp = 0, dot = 0, cur_duration, cur_octave;
-	static short tone[4][12] = {
-		/* C, C#, D, D#, E, F, F#, G, G#, A, A#, B */
-		{ 262, 277, 294, 311, 330, 349, 370, 392, 415,
-		  440, 466, 494 }, /* Octave #4 */
-		{ 523, 554, 587, 622, 659, 698, 740, 784, 831,
-		  880, 932, 988 }, /* Octave #5 */
-		{ 1047, 1109, 1175, 1245, 1319, 1397, 1480, 1568,
-		  1661, 1760, 1865, 1976 }, /* Octave #6 */
-		{ 2093, 2217, 2349, 2489, 2637, 2794, 2960, 3136,
-		  3322, 3520, 3729, 3951 }, /* Octave #7 */
-	};
-	/* Note column in tone array */
-	static signed char note_tone_col[2][7] = {
-		/* A, B, C, D, E, F, G */
-		{ 9, 11, 0, 2, 4, 5, 7 }, /* sharp=0 */
-		{ 10, 11, 1, 3, 4, 6, 8 }, /* sharp=1 */
-	};
+static int load_library(const char *path, struct library *lib)
+{
+	struct library_entry *e;
+	const char *s, *q, *next, *end;
+	int line, alloc = 0;
 
-	/* Get duration */
-	c = *p++;
-	switch (c) {
-	case '1':
-		if (*p == '6') {
-			p++;
-			cur_duration = 16;
-			break;
+	memset(lib, 0, sizeof(*lib));
+	if (!(lib->data = map_file(path, &lib->size, &lib->mapped)))
+		return -1;
+
+	end = lib->data + lib->size;
+	for (line = 1, s = lib->data; s < end; s = next, line++) {
+		q = memchr(s, '\n', end - s);
+		next = q ? q + 1 : end;
+		if (!q)
+			q = end;
+
+		/* Trim spaces and quotes */
+		while (s < q && isspace(*s))
+			s++;
+		while (q > s && isspace(q[-1]))
+			q--;
+		if (q - s >= 2 && *s == '"' && q[-1] == '"') {
+			s++;
+			q--;
 		}
-	case '2':
-	case '4':
-	case '8':
-		cur_duration = c - '0';
-		break;
-	case '3':
-		if (*p++ != '2') {
-			WARN("Note #%d: expected duration 32", ni);
-			return -1;
+		if (q <= s)
+			continue;
+
+		if (lib->n == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			if (!(e = realloc(lib->e, alloc * sizeof(*e)))) {
+				ERR("Failed to allocate library of %d melodies",
+				  alloc);
+				free_library(lib);
+				return -1;
+			}
+			lib->e = e;
 		}
-		cur_duration = 32;
-		break;
-	default:
-		cur_duration = duration;
-		p--;
-		break;
+
+		e = &lib->e[lib->n++];
+		e->line = line;
+		e->melody = s;
+		e->len = q - s;
+		e->events = NULL;
+		melody_name(s, e->len, e->name);
 	}
 
-	*duration_usec = whole_note_ms * 1000 / cur_duration;
+	return 0;
+}
 
-	/* Get note */
-	c = *p++;
-	if (c >= 'a' && c <= 'z')
-		c -= 'a' - 'A';
-	if (c >= 'A' && c <= 'G' || c == 'P' /* Pause */) {
-		note = c;
-	} else {
-		WARN("Note #%d: expected note (CDEFGAB)", ni);
-		return -1;
-	}
+static void *library_worker(void *arg)
+{
+	struct library *lib = arg;
+	struct library_entry *e;
+	struct parser ps;
+	int i;
 
-	c = *p;
-	if (c == '#') {
-		sharp = 1;
-		c = *++p;
-		if (c == '.') {
-			dot = 1;
-			p++;
+	while ((i = __atomic_fetch_add(&lib->next, 1, __ATOMIC_RELAXED))
+	  < lib->n) {
+		e = &lib->e[i];
+		DEBUG("Line %d: melody \"%s\"", e->line, e->name);
+		melody_parser_init(&ps, e->err, sizeof(e->err));
+		e->valid = !compile_span(&ps, e->melody, e->len, &e->events,
+		  &e->n_events);
+		e->n_notes = ps.n_notes;
+		if (!e->valid) {
+			e->events = NULL;
+			e->n_events = e->n_notes = 0;
+		} else if (!lib->keep_events) {
+			free(e->events);
+			e->events = NULL;
 		}
-	} else if (c == '.') {
-		dot = 1;
-		p++;
 	}
 
-	if (dot) {
-		*duration_usec += *duration_usec/2;
-	}
+	return NULL;
+}
 
-	/* Get octave */
-	c = *p;
-	if (!c) {
-		cur_octave = octave;
-	} else {
-		if (c < '4' || c > '7') {
-			WARN("Note #%d: expected octave (4-7)", ni);
-			return -1;
-		}
-		cur_octave = c - '0';
-	}
+/*
+ * Compile all melodies of library with @jobs threads. Invalid
+ * melodies are reported and stay in the library marked not valid.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int compile_library(struct library *lib, int jobs)
+{
+	pthread_t tid[64];
+	int i, n;
 
+	if (jobs > sizeof(tid) / sizeof(tid[0]))
+		jobs = sizeof(tid) / sizeof(tid[0]);
 
-	*freq = (note == 'P') ? 0 :
-		tone[cur_octave - 4][note_tone_col[sharp][note - 'A']];
+	/* Calling thread is a worker too */
+	for (n = 0; n < jobs - 1; n++) {
+		if ((errno = pthread_create(&tid[n], NULL, library_worker, lib))) {
+			WARN("Failed to create worker thread: %s",
+			  strerror(errno));
+			break;
+		}
+	}
+	library_worker(lib);
+	for (i = 0; i < n; i++)
+		pthread_join(tid[i], NULL);
 
-	DEBUG("Note #%d: note = %c%c, octave = %d, duration = %d%c, freq,HZ = %d,"
-		" duration,msecs = %d", ni, note, sharp ? '#' : ' ', cur_octave,
-		cur_duration, dot ? '.' : ' ', *freq, *duration_usec/1000);
+	for (i = 0; i < lib->n; i++) {
+		if (!lib->e[i].valid) {
+			ERR("Line %d: invalid melody \"%s\": %s", lib->e[i].line,
+			  lib->e[i].name, lib->e[i].err);
+			lib->n_invalid++;
+		}
+		lib->n_notes += lib->e[i].n_notes;
+	}
 
 	return 0;
 }
 
-static inline const char *skip_ws(const char *s)
+/* Write valid melodies of compiled library to binary file @path */
+static int export_library(const struct library *lib, const char *path)
 {
-	while (isspace(*s))
-		s++;
-	return s;
-}
+	struct melody_bin_entry *be;
+	int i, n = 0, err;
 
-/*
- * Parse numeric parameter setting in format: "letter=num".
- * After num expects ',' or '\0'. Used for parsing melody
- * defaults section (e.g. "o=5,b=120,d=4").
- *
- * Return: pointer to the next char or NULL (in case of error
- *   or empty string).
- * Out: @c -- parameter letter, @n -- parameter numeric
- *   value (max 999), @err -- error status.
- */
-static const char *char_eq_num(const char *s, int *c, int *n, int *err)
-{
-	*err = 0;
-	s = skip_ws(s);
-	if (!*s)
-		return NULL;
-	*err = -1;
-	*c = *s++;
-	s = skip_ws(s);
-	if (*s != '=')
-		return NULL;
-	s = skip_ws(s + 1);
-	if (!isdigit(*s))
-		return NULL;
-	*n = *s++ - '0';
-	while (isdigit(*s) && *n < 999) {
-		*n =  *n * 10 + (*s - '0');
-		s++;
+	if (!(be = malloc((lib->n + 1) * sizeof(*be)))) {
+		ERR("Failed to allocate export index");
+		return -1;
 	}
-	if (*s) {
-		if (*s++ != ',')
-			return NULL;
+	for (i = 0; i < lib->n; i++) {
+		if (!lib->e[i].valid)
+			continue;
+		be[n].name = lib->e[i].name;
+		be[n].events = lib->e[i].events;
+		be[n].n_events = lib->e[i].n_events;
+		n++;
 	}
-	*err = 0;
-	return s;
+
+	if ((err = melody_bin_write(path, be, n)))
+		ERR("Failed to write \"%s\": %s", path, strerror(errno));
+	else
+		DEBUG("Exported %d melodies to \"%s\"", n, path);
+
+	free(be);
+	return err;
 }
 
 /*
- * Parse string of numeric parameters separated with comma.
- * Used for parsing melody defaults section, e.g. "d=4,o=5,b=120".
+ * Render compiled melody transformed by @xform to WAV file @path
+ * ('-' -- stdout) at once, without playing.
  *
- * Out: @num[26]: <0 -- missing, >=0 -- parameter value.
- * Return: 0 -- Ok, <0 -- error.
+ * Return: 0 -- Ok, <0 -- error,
  */
-static int parse_char_eq_num_str(const char *s, int num[26])
+static int render_melody(const char *path, const struct note_event *events,
+  int n_events)
 {
-	int i, c, n, err;
+	struct note_event *ev = NULL;
+	struct renderer r;
+	int lap, err = 0;
 
-	for (i = 0; i < 26; i++)
-		num[i] = -1;
-	while (s = char_eq_num(s, &c, &n, &err)) {
-		if (num[c - 'a'] < 0) {
-			num[c - 'a'] = n;
-		} else {
-			WARN("Default param '%c' has been already set", c);
+	if (xform.semitones || xform.tempo_pct) {
+		if (transform_events(&xform, &tuning, events, n_events, &ev)) {
+			ERR("Failed to transform melody");
+			return -1;
 		}
+		events = ev;
+	}
+
+	if (render_open(&r, path, RENDER_RATE)) {
+		ERR("Failed to create \"%s\": %s", path, strerror(errno));
+		free(ev);
+		return -1;
 	}
+	for (lap = 0; !err && (!lap || lap < xform.loops); lap++)
+		err = render_events(&r, events, n_events);
+	if (render_close(&r))
+		err = -1;
+	if (err)
+		ERR("Failed to write \"%s\": %s", path, strerror(errno));
+	else
+		DEBUG("Rendered %d events %d times to \"%s\"", n_events, lap,
+		  path);
+	free(ev);
 	return err;
 }
 
-#define DEFAULTS(c) (defaults[(c) - 'a'])
+/* Render valid melodies of compiled library, or only @name, to DIR/NAME.wav */
+static int render_library(const struct library *lib, const char *dir,
+  const char *name)
+{
+	char path[4096], *p;
+	int i, n = 0;
+
+	for (i = 0; i < lib->n; i++) {
+		if (!lib->e[i].valid || name && strcmp(lib->e[i].name, name))
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s.wav", dir,
+		  lib->e[i].name) >= sizeof(path)) {
+			ERR("Too long path for melody \"%s\"", lib->e[i].name);
+			return -1;
+		}
+		/* Melody name may have '/' */
+		for (p = path + strlen(dir) + 1; *p; p++) {
+			if (*p == '/')
+				*p = '_';
+		}
+		if (render_melody(path, lib->e[i].events, lib->e[i].n_events))
+			return -1;
+		n++;
+	}
+
+	if (name && !n) {
+		ERR("No valid melody \"%s\" in library", name);
+		return -1;
+	}
+	return 0;
+}
 
 /*
- * Set defaults from melody defaults section.
+ * Compile library @path and play all its melodies in order or
+ * only melody @name. If @be is NULL, then only validate melodies
+ * with @jobs threads and report throughput. If @export is set,
+ * then compiled melodies are written to binary file @export
+ * instead of playing. If @render is set, then melodies are
+ * rendered to WAV files in directory @render instead of playing.
  *
- * Return: 0 -- Ok, <0 -- error (invalid or missing defaults).
+ * Return: 0 -- Ok, <0 -- error or invalid melodies,
  */
-static int set_defaults(const int defaults[26])
+static int run_batch(struct backend *be, const char *path, const char *name,
+  int jobs,
+  const char *export, const char *render)
 {
-	int n;
+	struct library lib;
+	struct timespec t0, t1;
+	double sec;
+	int i, played = 0;
 
-	n = DEFAULTS('o');
-	if (n < 0) {
-		ERR("Missing required default octave");
+	if (load_library(path, &lib))
 		return -1;
-	}
-	if (n < 4 || n > 7) {
-		ERR("Invalid default octave, must be 4-7");
+
+	if (export || render)
+		be = NULL;
+	lib.keep_events = be || export || render;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (compile_library(&lib, be ? 1 : jobs)) {
+		free_library(&lib);
 		return -1;
 	}
-	octave = n;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
 
-	n = DEFAULTS('d');
-	if (n < 0) {
-		ERR("Missing required default duration");
+	if (export && export_library(&lib, export)
+	  || render && render_library(&lib, render, name)) {
+		free_library(&lib);
 		return -1;
 	}
-	if (n != 1 && n != 2 && n != 4 && n != 8 && n != 16 && n != 32) {
-		ERR("Invalid default duration, must be 1,2,4,8,16,32");
-		return -1;
+
+	if (!be && !export && !render) {
+		sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		printf("%d melodies, %d invalid, %ld notes in %.3f s, "
+		  "%.0f melodies/s, %.0f notes/s\n", lib.n, lib.n_invalid,
+		  lib.n_notes, sec, sec > 0 ? lib.n / sec : 0,
+		  sec > 0 ? lib.n_notes / sec : 0);
 	}
-	duration = n;
 
-	n = DEFAULTS('b');
-	if (n < 0) {
-		ERR("Missing required default beats");
-		return -1;
+	for (i = 0; be && !stopped && i < lib.n; i++) {
+		if (!lib.e[i].valid || name && strcmp(lib.e[i].name, name))
+			continue;
+		DEBUG("Playing melody \"%s\"", lib.e[i].name);
+		if (play_xf(be, lib.e[i].events, lib.e[i].n_events))
+			break;
+		played++;
 	}
-	if (n < 40 || n > 200) {
-		ERR("Invalid default beats, must be 40-200");
+
+	free_library(&lib);
+
+	if (be && name && !played) {
+		ERR("No valid melody \"%s\" in library", name);
 		return -1;
 	}
-	tempo = n;
 
-	DEBUG("Defaults: octave=%d, duration=%d, beats/tempo=%d", octave, duration, tempo);
+	return lib.n_invalid ? -1 : 0;
+}
+
+/*
+ * Play all melodies of binary file @path in order or only
+ * melody @name. Events are played right from the mapped file.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int run_bin(struct backend *be, const char *path, const char *name)
+{
+	struct melody_bin bin;
+	const struct melody_bin_index *bi;
+	uint32_t i;
+
+	if (melody_bin_open(path, &bin)) {
+		ERR("Failed to open compiled melodies \"%s\": %s", path,
+		  strerror(errno));
+		return -1;
+	}
 
-	whole_note_ms = (60000 * 4) / tempo;
-	DEBUG("Note duration,ms: %d", whole_note_ms);
+	if (name) {
+		if (!(bi = melody_bin_find(&bin, name))) {
+			ERR("No melody \"%s\" in \"%s\"", name, path);
+			melody_bin_close(&bin);
+			return -1;
+		}
+		play_xf(be, bin.events + bi->first, bi->n_events);
+	} else {
+		for (i = 0; !stopped && i < bin.hdr->n_melodies; i++) {
+			bi = &bin.index[i];
+			DEBUG("Playing melody \"%s\"", bi->name);
+			play_xf(be, bin.events + bi->first, bi->n_events);
+		}
+	}
 
+	melody_bin_close(&bin);
 	return 0;
 }
 
-static void beeper_tone(int fd, int freq, int duration_usec)
+/*
+ * Read whole melody from @path, compile and play it or, if
+ * @render is set, render it to WAV file @render. Unlike
+ * play_stream() all events are kept, so melody may be looped.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int play_file(const char *path, struct backend *be,
+  const char *render)
 {
-	static struct input_event ev;
+	struct note_event *events;
+	struct parser ps;
+	char *melody;
+	size_t size;
+	int n, err;
 
-	ev.type = EV_SND;
-	ev.code = SND_TONE;
-	ev.value = freq;
-	write(fd, &ev, sizeof(ev));
-	usleep(duration_usec);
-	ev.value = 0;
-	write(fd, &ev, sizeof(ev));
+	if (!(melody = read_file(path, &size)))
+		return -1;
+	melody_parser_init(&ps, NULL, 0);
+	err = compile_span(&ps, melody, size, &events, &n);
+	free(melody);
+	if (err)
+		return -1;
+	err = render ? render_melody(render, events, n)
+	  : play_xf(be, events, n);
+	free(events);
+	return err;
 }
 
-/* Play melody */
-static int play(int fd, const char *melody)
-{
-	const char *p, *q;
-	int freq, duration_usec;
-	char buf[32];
-	int defaults[26];
-	int n, i;
+static void show_help(void) {
+	static const char *help_str =
+		"Play melody on beeper.\n\n"
+		"Usage: beep_melody [OPTIONS]\n\n"
+		"Options:\n"
+		"* -e LIST -- event devices: comma separated numbers N\n"
+		"*   (/dev/input/eventN), names in /dev/input or paths, may be\n"
+		"*   globs, e.g. '0,event[2-3],/dev/input/by-path/*-event-spkr'.\n"
+		"*   'auto' -- all beepers found in /dev/input. All devices play\n"
+		"*   the same schedule. Default is 'auto'. With '-s', devices\n"
+		"*   are looked up again on hotplug,\n"
+		"* -B SPEC -- sound backend instead of event device: 'null',\n"
+		"*   'file:PATH' -- record timestamped input events to file or\n"
+		"*   pipe PATH ('-' -- stdout), 'uinput[:NAME]' -- virtual EV_SND\n"
+		"*   device, 'console[:TTY]' -- KIOCSOUND ioctl on console TTY\n"
+		"*   (/dev/tty0), 'pwm:PATH' -- sysfs PWM channel, e.g.\n"
+		"*   /sys/class/pwm/pwmchip0/pwm0, 'wav:PATH' -- square wave WAV\n"
+		"*   file or pipe PATH ('-' -- stdout); in daemon mode it is\n"
+		"*   rendered in real time, otherwise melody is rendered at once,\n"
+		"* --render=PATH -- render melody to WAV file PATH ('-' -- stdout)\n"
+		"*   at once, without playing. With '-f', render all melodies\n"
+		"*   (or only '-n NAME') to directory PATH as NAME.wav,\n"
+		"* -d -- debug. Messages are buffered and printed after each\n"
+		"*   melody, so they don't disturb its timing,\n"
+		"* -s PATH -- run as daemon, accept melodies on Unix socket PATH,\n"
+		"* -c PATH -- submit melody from stdin to daemon on socket PATH\n"
+		"*   and wait until it starts (fails, if it is dropped from queue),\n"
+		"* -p -- with '-c', compile melody before submitting it,\n"
+		"* --metrics -- with '-c', print metrics of daemon in Prometheus\n"
+		"*   text format. Daemon dumps them to stderr on SIGUSR1 too,\n"
+		"* -t, --tones -- with '-c', submit tones read from stdin as HZ:ms\n"
+		"*   tuples (HZ=0 -- pause) through shared memory ring,\n"
+		"* -P PRIO, --priority=PRIO -- with '-c', priority of melody.\n"
+		"*   Melody of higher priority preempts the playing one at the\n"
+		"*   end of its current note. Default is 0,\n"
+		"* --now -- with '-P', preempt at once,\n"
+		"* --resume -- with '-c', if melody is preempted, resume it\n"
+		"*   after melodies of higher priority instead of discarding,\n"
+		"* -f FILE -- play all melodies from library FILE (one per line),\n"
+		"* -n NAME -- with '-f', play only melody NAME; with '-c', play\n"
+		"*   melody cached by daemon by its NAME,\n"
+		"* -C, --validate -- with '-f', only compile melodies to check them,\n"
+		"* -o FILE -- with '-f', export compiled melodies to binary FILE,\n"
+		"* -b FILE -- play melodies from binary FILE exported with '-o'\n"
+		"*   (all or only '-n NAME'); with '-s', serve melodies by name\n"
+		"*   from FILE,\n"
+		"* -j N -- with '-C', compile melodies with N threads. Default is 1,\n"
+		"* -r PRIO, --realtime=PRIO -- play with SCHED_FIFO priority PRIO\n"
+		"*   (1-99) and locked memory,\n"
+		"* -a CPU, --cpu=CPU -- pin playback to CPU,\n"
+		"* --timing-report[=FILE] -- measure lateness of tone changes and\n"
+		"*   print report to FILE (stderr by default) after playback; in\n"
+		"*   daemon mode after every melody. Each write is listed as\n"
+		"*   'write: INDEX DEADLINE ACTUAL LATENESS_USEC' before summary,\n"
+		"* --transpose=N -- transpose melody by N semitones (may be <0),\n"
+		"* --tempo=PCT -- play at PCT percent of melody tempo,\n"
+		"* --loop=N -- play melody N times, 0 -- until stopped (by Ctrl-C\n"
+		"*   or, with '-c', by '--stop'). With '-c', melody is\n"
+		"*   transformed by daemon, cached melody stays unchanged,\n"
+		"* --stop -- with '-c', stop melody playing by daemon, it isn't\n"
+		"*   resumed,\n"
+		"* --a4=HZ -- tune notes to A4 of HZ (400-480, may be fractional,\n"
+		"*   e.g. 432). Default is 440,\n"
+		"* --articulation=ART -- pause at the end of every note: 'legato'\n"
+		"*   (none), 'normal' (20% of note), 'staccato' (50%) or percent\n"
+		"*   0-90. Default is 'normal',\n"
+		"* -h -- show this help,\n";
 
-	/* Skip melody name (if there) */
-	p = strchr(melody, ':');
-	if (p)
-		melody = p++;
+	fprintf(stderr, "%s\n", help_str);
+}
 
-	/* Parse defaults section */
-	q = strchr(p, ':');
-	if (!p) {
-		ERR("Missing required defaults section in melody");
-		return -1;
-	}
+/* Return: pause percent of articulation @s (name or number), <0 -- error */
+static int parse_articulation(const char *s)
+{
+	static const struct {
+		const char *name;
+		int gap_pct;
+	} names[] = {
+		{ "legato", ARTICULATION_LEGATO },
+		{ "normal", ARTICULATION_NORMAL },
+		{ "staccato", ARTICULATION_STACCATO },
+	};
+	char *end;
+	long n;
+	int i;
 
-	if (q - p >= sizeof(buf)) {
-		ERR("Too long defaults section");
-		return -1;
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (!strcmp(s, names[i].name))
+			return names[i].gap_pct;
 	}
-	strncpy(buf, p, q - p);
-	buf[q - p] = '\0';
-	p = ++q;
+	n = strtol(s, &end, 10);
+	if (end == s || *end || n < 0 || n > ARTICULATION_MAX)
+		return -1;
+	return n;
+}
 
-	DEBUG("Defaults section: %s", buf);
+#define MAX_DEVICES 64
+
+/*
+ * Expand list of event devices: comma separated numbers N
+ * (/dev/input/eventN), names in /dev/input or paths, any of them
+ * may be a glob pattern, and 'auto' -- all beepers found in
+ * /dev/input, cached ones unless @refresh.
+ *
+ * Out: @g -- paths of devices (caller must globfree() it),
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int expand_devices(const char *list, glob_t *g, int refresh)
+{
+	struct snd_device dev[DISCOVER_MAX];
+	char pattern[256];
+	const char *s, *q;
+	int i, n, len, err, flags = 0;
 
-	if (parse_char_eq_num_str(buf, defaults)) {
-		ERR("Failed to parse defaults section");
+	memset(g, 0, sizeof(*g));
+	for (s = list; *s; s = *q ? q + 1 : q) {
+		q = strchrnul(s, ',');
+		len = q - s;
+		if (!len)
+			continue;
+		if (len == 4 && !strncmp(s, "auto", 4)) {
+			if ((n = discover_devices(dev, DISCOVER_MAX, refresh)) < 0) {
+				ERR("Failed to find beepers in \"%s\": %s",
+				  DISCOVER_DIR, strerror(errno));
+				globfree(g);
+				return -1;
+			}
+			/* Literal paths, no match is needed */
+			for (i = 0; i < n; i++) {
+				DEBUG("Found beeper \"%s\" (%s)", dev[i].path,
+				  dev[i].name);
+				if (glob(dev[i].path, flags | GLOB_NOCHECK
+				  | GLOB_NOESCAPE, NULL, g)) {
+					globfree(g);
+					return -1;
+				}
+				flags |= GLOB_APPEND;
+			}
+			continue;
+		}
+		if (strspn(s, "0123456789") == len)
+			snprintf(pattern, sizeof(pattern), "/dev/input/event%.*s",
+			  len, s);
+		else if (memchr(s, '/', len))
+			snprintf(pattern, sizeof(pattern), "%.*s", len, s);
+		else
+			snprintf(pattern, sizeof(pattern), "/dev/input/%.*s",
+			  len, s);
+		/* Pattern may match nothing until hotplug, path must exist */
+		err = glob(pattern, flags, NULL, g);
+		if (err == GLOB_NOMATCH && strpbrk(pattern, "*?["))
+			continue;
+		if (err) {
+			ERR("Failed to find event device \"%s\"", pattern);
+			globfree(g);
+			return -1;
+		}
+		flags |= GLOB_APPEND;
+	}
+	if (!g->gl_pathc) {
+		ERR("No event devices in \"%s\"", list);
+		globfree(g);
 		return -1;
 	}
+	return 0;
+}
 
-	if (set_defaults(defaults))
-		return -1;
+/*
+ * Open backend @spec or event devices @devices if @spec is NULL.
+ * Several devices are opened as a group, which plays the same
+ * schedule on all of them. Beepers are looked up again (@refresh)
+ * if a cached one is gone.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+static int open_backend(struct backend *be, const char *spec,
+  const char *devices, int refresh)
+{
+	char event_dev[256];
+	struct backend *members;
+	glob_t g;
+	int i, err, stale;
 
-	/* Parse notes section and play */
-	for (i = 1, n = strlen(melody); (p < melody + n)
-	  && (p = skip_ws(p)); i++) {
-		q = strchr(p, ',');
-		if (!q)
-			q = melody + n;
-		if (q - p >= sizeof(buf)) {
-			ERR("Too long note #%d", i);
+	if (spec) {
+		if (backend_open(be, spec)) {
+			ERR("Failed to open backend \"%s\": %s", spec,
+			  strerror(errno));
 			return -1;
 		}
-		strncpy(buf, p, q - p);
-		buf[q - p] = '\0';
-		DEBUG("Note #%d: %s", i, buf);
-		p = ++q;
-		if (parse_note(i, buf, &freq, &duration_usec))
-			continue;
-		beeper_tone(fd, freq, duration_usec);
-		usleep(duration_usec / 4);
+		return 0;
+	}
+
+	if (expand_devices(devices, &g, refresh))
+		return -1;
+	if (g.gl_pathc > MAX_DEVICES) {
+		ERR("Too many event devices: %zu (max %d)", g.gl_pathc,
+		  MAX_DEVICES);
+		globfree(&g);
+		return -1;
+	}
+	if (!(members = calloc(g.gl_pathc, sizeof(*members)))) {
+		globfree(&g);
+		return -1;
+	}
+	for (i = 0; i < g.gl_pathc; i++) {
+		snprintf(event_dev, sizeof(event_dev), "evdev:%s",
+		  g.gl_pathv[i]);
+		if (backend_open(&members[i], event_dev)) {
+			err = errno;
+			stale = !refresh && (err == ENOENT || err == ENODEV
+			  || err == ENXIO);
+			if (stale)
+				DEBUG("Event device \"%s\" is gone, looking up "
+				  "beepers again", g.gl_pathv[i]);
+			else
+				ERR("Failed to open event device \"%s\": %s",
+				  g.gl_pathv[i], strerror(err));
+			while (i--)
+				backend_close(&members[i]);
+			free(members);
+			globfree(&g);
+			return stale ? open_backend(be, NULL, devices, 1) : -1;
+		}
+		DEBUG("Opened event device \"%s\"", g.gl_pathv[i]);
 	}
 
+	if (g.gl_pathc == 1) {
+		*be = members[0];
+		free(members);
+	} else {
+		backend_group(be, members, g.gl_pathc);
+	}
+	globfree(&g);
 	return 0;
 }
 
-static void show_help(void) {
-	static const char *help_str =
-		"Play melody on beeper.\n\n"
-		"Usage: beep_melody [OPTIONS]\n\n"
-		"Options:\n"
-		"* -e N -- input event number (/dev/input/eventN). Default is 0,\n"
-		"* -d -- debug,\n"
-		"* -h -- show this help,\n";
-
-	fprintf(stderr, "%s\n", help_str);
-}
+/* Options w/o short form */
+enum long_opts {
+	OPT_TIMING_REPORT=256,
+	OPT_NOW,
+	OPT_RESUME,
+	OPT_TRANSPOSE,
+	OPT_TEMPO,
+	OPT_LOOP,
+	OPT_A4,
+	OPT_ARTICULATION,
+	OPT_RENDER,
+	OPT_METRICS,
+	OPT_STOP,
+};
 
 int main(int argc, char *argv[])
 {
-	int fd, event_num = 0, c, n;
-	char event_dev[256];
-	char melody[1024];
+	int c, n, precompile = 0, compile_only = 0, priority = 0, tones = 0;
+	int metrics_only = 0, stop = 0;
+	unsigned int req_flags = 0;
+	const char *daemon_path = NULL, *client_path = NULL, *name = NULL;
+	const char *library = NULL, *export = NULL, *bin_path = NULL;
+	const char *backend = NULL, *devices = "auto", *render = NULL;
+	struct melody_bin bin;
+	struct backend be;
+	struct sigaction sa;
+	int jobs = 1;
+	static const struct option long_opts[] = {
+		{ "validate", no_argument, NULL, 'C' },
+		{ "realtime", required_argument, NULL, 'r' },
+		{ "cpu", required_argument, NULL, 'a' },
+		{ "timing-report", optional_argument, NULL, OPT_TIMING_REPORT },
+		{ "priority", required_argument, NULL, 'P' },
+		{ "tones", no_argument, NULL, 't' },
+		{ "transpose", required_argument, NULL, OPT_TRANSPOSE },
+		{ "tempo", required_argument, NULL, OPT_TEMPO },
+		{ "loop", required_argument, NULL, OPT_LOOP },
+		{ "a4", required_argument, NULL, OPT_A4 },
+		{ "articulation", required_argument, NULL, OPT_ARTICULATION },
+		{ "render", required_argument, NULL, OPT_RENDER },
+		{ "metrics", no_argument, NULL, OPT_METRICS },
+		{ "stop", no_argument, NULL, OPT_STOP },
+		{ "now", no_argument, NULL, OPT_NOW },
+		{ "resume", no_argument, NULL, OPT_RESUME },
+		{ NULL, 0, NULL, 0 },
+	};
+	char *melody = NULL, *end;
+	size_t melody_size = 0;
+	double a4;
 
-	while ((c = getopt(argc, argv, "e:dh")) != -1) {
+	tuning = *default_tuning;
+	while ((c = getopt_long(argc, argv, "e:B:ds:c:ptP:f:n:Cj:o:b:r:a:h", long_opts,
+	  NULL)) != -1) {
 		switch(c) {
 		case 'e':
-			event_num = atoi(optarg);
+			devices = optarg;
+			break;
+		case 'B':
+			backend = optarg;
 			break;
 		case 'd':
 			debug = 1;
 			break;
+		case 's':
+			daemon_path = optarg;
+			break;
+		case 'c':
+			client_path = optarg;
+			break;
+		case 'p':
+			precompile = 1;
+			break;
+		case 't':
+			tones = 1;
+			break;
+		case 'P':
+			priority = atoi(optarg);
+			break;
+		case OPT_NOW:
+			req_flags |= REQ_F_NOW;
+			break;
+		case OPT_RESUME:
+			req_flags |= REQ_F_RESUME;
+			break;
+		case OPT_TRANSPOSE:
+			xform.semitones = atoi(optarg);
+			break;
+		case OPT_TEMPO:
+			xform.tempo_pct = atoi(optarg);
+			break;
+		case OPT_LOOP:
+			/* Negative count is left to transform_check() */
+			if (!(xform.loops = atoi(optarg)))
+				xform.loops = TRANSFORM_LOOP_FOREVER;
+			else if (xform.loops < 0)
+				xform.loops = TRANSFORM_LOOP_FOREVER - 1;
+			break;
+		case OPT_A4:
+			a4 = strtod(optarg, &end);
+			if (end == optarg || *end || !(a4 >= TUNING_MIN_A4 / 1000.0
+			  && a4 <= TUNING_MAX_A4 / 1000.0)) {
+				fprintf(stderr, "Invalid A4 frequency %s, must be "
+				  "%d-%d HZ\n", optarg, TUNING_MIN_A4 / 1000,
+				  TUNING_MAX_A4 / 1000);
+				return -1;
+			}
+			tuning_init(&tuning, a4 * 1000 + 0.5);
+			break;
+		case OPT_RENDER:
+			render = optarg;
+			break;
+		case OPT_METRICS:
+			metrics_only = 1;
+			break;
+		case OPT_STOP:
+			stop = 1;
+			break;
+		case OPT_ARTICULATION:
+			if ((gap_pct = parse_articulation(optarg)) < 0) {
+				fprintf(stderr, "Invalid articulation %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'f':
+			library = optarg;
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		case 'C':
+			compile_only = 1;
+			break;
+		case 'o':
+			export = optarg;
+			break;
+		case 'b':
+			bin_path = optarg;
+			break;
+		case 'r':
+			rt_prio = atoi(optarg);
+			if (rt_prio < sched_get_priority_min(SCHED_FIFO)
+			  || rt_prio > sched_get_priority_max(SCHED_FIFO)) {
+				fprintf(stderr, "Invalid real-time priority %s\n",
+				  optarg);
+				return -1;
+			}
+			break;
+		case 'a':
+			rt_cpu = atoi(optarg);
+			break;
+		case OPT_TIMING_REPORT:
+			if (!optarg) {
+				timing_out = stderr;
+			} else if (!(timing_out = fopen(optarg, "w"))) {
+				fprintf(stderr, "Failed to open \"%s\": %s\n",
+				  optarg, strerror(errno));
+				return -1;
+			}
+			if (!timing.recs && !(timing.recs = calloc(TIMING_RECORDS,
+			  sizeof(*timing.recs))))
+				WARN("No memory for per-write timing lines");
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1)
+				jobs = 1;
+			break;
 		case 'h':
 			show_help();
 			return 0;
@@ -404,24 +2759,99 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	if (fgets(melody, sizeof(melody) - 1, stdin)) {
-		n = strlen(melody);
-		if (!n)
-			return 0;
-		if (melody[n - 1] == '\n')
-			melody[n - 1] = '\0';
-	} else {
-		ERR("Failed to read melody from stdin: %s",
-		  strerror(errno));
+	if (debug && trace_start())
+		WARN("Failed to create trace thread: %s", strerror(errno));
+
+	if (transform_check(&xform)) {
+		fprintf(stderr, "Invalid transformation, supported: transpose "
+		  "%d..%d, tempo %d..%d%%, loop >= 0\n",
+		  -TRANSFORM_MAX_SEMITONES, TRANSFORM_MAX_SEMITONES,
+		  TRANSFORM_MIN_TEMPO, TRANSFORM_MAX_TEMPO);
+		return -1;
+	}
+	if (xform.loops == TRANSFORM_LOOP_FOREVER && render) {
+		ERR("'--loop=0' can't be rendered");
 		return -1;
 	}
 
-	snprintf(event_dev, sizeof(event_dev), "/dev/input/event%d", event_num);
-	if ((fd = open(event_dev, O_WRONLY)) < 0) {
-		ERR("Failed to open event device \"%s\": %s\n",
-		  event_dev, strerror(errno));
+	if (daemon_path) {
+		if (bin_path && melody_bin_open(bin_path, &bin)) {
+			ERR("Failed to open compiled melodies \"%s\": %s",
+			  bin_path, strerror(errno));
+			return -1;
+		}
+		if (open_backend(&be, backend, devices, 0))
+			return -1;
+		return run_daemon(&be, backend ? NULL : devices, daemon_path,
+		  bin_path ? &bin : NULL);
+	}
+
+	if (library && (compile_only || export))
+		return run_batch(NULL, library, NULL, jobs, export, NULL);
+
+	if (render) {
+		if (bin_path) {
+			ERR("'--render' works with melody from stdin or '-f'");
+			return -1;
+		}
+		return library ? run_batch(NULL, library, name, jobs, NULL, render)
+		  : play_file("/dev/stdin", NULL, render);
+	}
+
+	if (client_path && metrics_only)
+		return run_metrics_client(client_path);
+
+	if (client_path && stop)
+		return run_stop_client(client_path);
+
+	if (client_path && tones)
+		return run_ring_client(client_path, priority);
+
+	if (client_path && name)
+		return run_client(client_path, NULL, name, 0, priority,
+		  req_flags);
+
+	if (client_path) {
+		if ((n = getline(&melody, &melody_size, stdin)) < 0) {
+			ERR("Failed to read melody from stdin");
+			return -1;
+		}
+		if (n && melody[n - 1] == '\n')
+			melody[n - 1] = '\0';
+		n = run_client(client_path, melody, NULL, precompile, priority,
+		  req_flags);
+		free(melody);
+		return n;
+	}
+
+	if (open_backend(&be, backend, devices, 0))
+		return -1;
+	if (xform.loops == TRANSFORM_LOOP_FOREVER && backend_has_batch(&be)) {
+		ERR("'--loop=0' isn't supported by backend");
+		backend_close(&be);
 		return -1;
 	}
 
-	return play(fd, melody);
+	rt_setup();
+
+	/* The first Ctrl-C stops playback, the second one kills */
+	sa.sa_handler = on_stop;
+	sa.sa_flags = SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (bin_path)
+		n = run_bin(&be, bin_path, name);
+	else if (library)
+		n = run_batch(&be, library, name, 1, NULL, NULL);
+	else
+		n = xform.loops > 1 || xform.loops == TRANSFORM_LOOP_FOREVER
+		  || backend_has_batch(&be)
+		  ? play_file("/dev/stdin", &be, NULL)
+		  : play_stream(STDIN_FILENO, &be);
+	timing_print();
+
+	backend_close(&be);
+	return n;
 }
@@ -0,0 +1,88 @@
+/*
+ * libbeepmelody: compile RTTTL melodies and play them in background.
+ *
+ * Melodies started with bm_play_async() are played concurrently by
+ * an internal thread with absolute note deadlines. Completion is
+ * reported by callback and by pollable fd, the caller must release
+ * the handle with bm_wait() in any case.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#ifndef BEEPMELODY_H
+#define BEEPMELODY_H
+
+/*
+ * Compiled note, opaque: arrays of events are only passed back to
+ * the library and freed with free()
+ */
+struct note_event;
+
+/* Playback handle */
+struct bm_player;
+
+/*
+ * Called on the playback thread when melody ends.
+ *
+ * In: @status -- 0 -- played to the end, -ECANCELED -- cancelled,
+ *   other <0 -- error,
+ */
+typedef void (*bm_done_cb)(struct bm_player *p, int status, void *arg);
+
+/*
+ * Compile melody.
+ *
+ * In: @err, @err_size -- buffer for error message (may be NULL),
+ * Out: @events -- note events (caller must free it), @n_events,
+ * Return: 0 -- Ok, <0 -- error,
+ */
+int bm_compile(const char *melody, struct note_event **events, int *n_events,
+  char *err, int err_size);
+
+/*
+ * Transpose by @semitones and scale tempo to @tempo_pct percent
+ * compiled melody (0 -- no change), no parsing is done. Loops are
+ * done by the player, see bm_play_loop().
+ *
+ * Out: @out -- @n_events transformed events (caller must free it),
+ * Return: 0 -- Ok, <0 -- error,
+ */
+int bm_transform(const struct note_event *events, int n_events,
+  int semitones, int tempo_pct, struct note_event **out);
+
+#define BM_LOOP_FOREVER (-1) /* Until bm_cancel() */
+
+/*
+ * Start playback of @events on backend @backend (see backend.h,
+ * e.g. "evdev:/dev/input/event0"). Events are copied, so caller
+ * may free them at once.
+ *
+ * In: @cb, @arg -- completion callback (may be NULL),
+ * Return: handle, NULL -- error (see errno),
+ */
+struct bm_player *bm_play_async(const char *backend,
+  const struct note_event *events, int n_events, bm_done_cb cb, void *arg);
+
+/*
+ * The same as bm_play_async(), but melody is played @loops times
+ * (0, 1 -- once) or BM_LOOP_FOREVER. Events aren't repeated in
+ * memory, the player wraps to the first one.
+ */
+struct bm_player *bm_play_loop(const char *backend,
+  const struct note_event *events, int n_events, int loops, bm_done_cb cb,
+  void *arg);
+
+/* Stop playback at once, beeper is turned off */
+void bm_cancel(struct bm_player *p);
+
+/* Return: fd which becomes readable when playback ends */
+int bm_fd(const struct bm_player *p);
+
+/*
+ * Wait for the end of playback and release handle.
+ *
+ * Return: status, the same as passed to completion callback,
+ */
+int bm_wait(struct bm_player *p);
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * Microbenchmark of note decoder: compares notes/sec of the table
+ * driven parse_note() with the legacy switch based decoder, which
+ * does less: no length bounds, octaves 4-7 only, trailing characters
+ * aren't checked. The process is pinned to one CPU, decoders run in
+ * alternating rounds and medians are reported, the range of per-round
+ * speedups shows the noise.
+ *
+ * Usage: ./bench_parser [N] -- decode every note N times per round
+ *   (100000)
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#define _GNU_SOURCE /* CPU affinity */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#include "rtttl.h"
+
+static const char *notes[] = {
+	"4d.6", "c6", "a#", "a", "4g", "g", "a#", "a", "g", "f", "g", "d",
+	"c", "2d.", "8e#6", "16p", "16e#6", "8c#7", "16g#6", "4g.", "p",
+	"4c.", "2f#.", "g.", "8d.6", "4c#6", "b.", "c#.6", "32b5", "16a",
+};
+
+#define N_NOTES (sizeof(notes) / sizeof(notes[0]))
+
+/* Syntax checked before benchmark, failures count as mismatches */
+static const struct {
+	const char *s;
+	int ok;
+	int dotted;
+} syntax[] = {
+	{ "c6", 1, 0 }, { "c6.", 1, 1 }, { "c.6", 1, 1 }, { "c#6.", 1, 1 },
+	{ "c.", 1, 1 }, { "c.6.", 0 }, { "d6#", 0 }, { "c6x", 0 },
+	{ "c66", 0 }, { "c6..", 0 }, { "h", 0 }, { "3c", 0 }, { "", 0 },
+};
+
+#define N_SYNTAX (sizeof(syntax) / sizeof(syntax[0]))
+#define ROUNDS 11 /* Odd, for median */
+
+/* Decoder as it was before duration and character class tables */
+struct legacy_parser {
+	int octave;
+	int duration;
+	int whole_note_ms;
+};
+
+static __attribute__((noinline))
+int legacy_parse_note(const struct legacy_parser *ps, const char *s,
+  int *freq, int *duration_usec)
+{
+	const char *p = s;
+	int c, note, sharp = 0, dot = 0, cur_duration, cur_octave;
+	static const short tone[4][12] = {
+		{ 262, 277, 294, 311, 330, 349, 370, 392, 415,
+		  440, 466, 494 },
+		{ 523, 554, 587, 622, 659, 698, 740, 784, 831,
+		  880, 932, 988 },
+		{ 1047, 1109, 1175, 1245, 1319, 1397, 1480, 1568,
+		  1661, 1760, 1865, 1976 },
+		{ 2093, 2217, 2349, 2489, 2637, 2794, 2960, 3136,
+		  3322, 3520, 3729, 3951 },
+	};
+	static const signed char note_tone_col[2][7] = {
+		{ 9, 11, 0, 2, 4, 5, 7 },
+		{ 10, 11, 1, 3, 4, 6, 8 },
+	};
+
+	c = *p++;
+	switch (c) {
+	case '1':
+		if (*p == '6') {
+			p++;
+			cur_duration = 16;
+			break;
+		}
+		/* Fall through */
+	case '2':
+	case '4':
+	case '8':
+		cur_duration = c - '0';
+		break;
+	case '3':
+		if (*p++ != '2')
+			return -1;
+		cur_duration = 32;
+		break;
+	default:
+		cur_duration = ps->duration;
+		p--;
+		break;
+	}
+
+	*duration_usec = ps->whole_note_ms * 1000 / cur_duration;
+
+	c = *p++;
+	if (c >= 'a' && c <= 'z')
+		c -= 'a' - 'A';
+	if (c >= 'A' && c <= 'G' || c == 'P')
+		note = c;
+	else
+		return -1;
+
+	c = *p;
+	if (c == '#') {
+		sharp = 1;
+		c = *++p;
+		if (c == '.') {
+			dot = 1;
+			p++;
+		}
+	} else if (c == '.') {
+		dot = 1;
+		p++;
+	}
+
+	if (dot)
+		*duration_usec += *duration_usec/2;
+
+	c = *p;
+	if (!c) {
+		cur_octave = ps->octave;
+	} else {
+		if (c < '4' || c > '7')
+			return -1;
+		cur_octave = c - '0';
+	}
+
+	*freq = (note == 'P') ? 0 :
+		tone[cur_octave - 4][note_tone_col[sharp][note - 'A']];
+
+	return 0;
+}
+
+static double now_sec(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double median(double *v, int n)
+{
+	qsort(v, n, sizeof(*v), cmp_double);
+	return v[n / 2];
+}
+
+int main(int argc, char *argv[])
+{
+	struct legacy_parser lps = { .octave = 5, .duration = 8,
+		.whole_note_ms = 60000 * 4 / 125 };
+	struct parser ps;
+	struct note_event *ev;
+	long i, iters = argc > 1 ? atol(argv[1]) : 100000;
+	long sum = 0;
+	int j, r, n, cpu, freq, freq2, duration_usec, dur, ok, mismatch = 0;
+	int lens[N_NOTES];
+	double t, legacy[ROUNDS], table[ROUNDS], ratio[ROUNDS];
+	struct parser sps;
+	char err[256];
+	cpu_set_t cpus;
+
+	/* Don't let migrations add to the noise */
+	if ((cpu = sched_getcpu()) >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus))
+			cpu = -1;
+	}
+
+	/* Set parser defaults */
+	parser_init(&ps, 0, NULL, 0);
+	if (compile(&ps, "Bench:d=8,o=5,b=125:c", &ev, &n))
+		return -1;
+	free(ev);
+
+	/* Warnings of syntax checks go to err, not to stderr */
+	parser_init(&sps, 0, err, sizeof(err));
+	if (compile(&sps, "Bench:d=8,o=5,b=125:c", &ev, &n))
+		return -1;
+	free(ev);
+	for (j = 0; j < N_SYNTAX; j++) {
+		*err = '\0';
+		ok = !parse_note(&sps, j + 1, syntax[j].s, strlen(syntax[j].s),
+		  &freq, &dur);
+		if (ok != syntax[j].ok || ok && dur != sps.duration_usec
+		  [syntax[j].dotted][sps.duration_idx]) {
+			fprintf(stderr, "Note \"%s\" is %s\n", syntax[j].s,
+			  ok ? "accepted" : "rejected");
+			mismatch++;
+		}
+	}
+
+	for (j = 0; j < N_NOTES; j++) {
+		lens[j] = strlen(notes[j]);
+		if (parse_note(&ps, j + 1, notes[j], lens[j], &freq,
+		  &duration_usec)
+		  || legacy_parse_note(&lps, notes[j], &freq2, &duration_usec)
+		  || freq != freq2)
+			mismatch++;
+	}
+
+	for (r = 0; r < ROUNDS; r++) {
+		t = now_sec();
+		for (i = 0; i < iters; i++) {
+			for (j = 0; j < N_NOTES; j++) {
+				legacy_parse_note(&lps, notes[j], &freq,
+				  &duration_usec);
+				sum += freq + duration_usec;
+			}
+		}
+		legacy[r] = iters * N_NOTES / (now_sec() - t);
+
+		t = now_sec();
+		for (i = 0; i < iters; i++) {
+			for (j = 0; j < N_NOTES; j++) {
+				parse_note(&ps, j + 1, notes[j], lens[j], &freq,
+				  &duration_usec);
+				sum += freq + duration_usec;
+			}
+		}
+		table[r] = iters * N_NOTES / (now_sec() - t);
+		ratio[r] = table[r] / legacy[r];
+	}
+
+	printf("notes: %ld\n", iters * (long)N_NOTES * ROUNDS);
+	printf("cpu: %d\n", cpu);
+	printf("legacy_notes_per_sec: %.0f\n", median(legacy, ROUNDS));
+	printf("table_notes_per_sec: %.0f\n", median(table, ROUNDS));
+	qsort(ratio, ROUNDS, sizeof(*ratio), cmp_double);
+	printf("speedup: %.2f (%.2f-%.2f)\n", ratio[ROUNDS / 2], ratio[0],
+	  ratio[ROUNDS - 1]);
+	printf("mismatch: %d\n", mismatch);
+	fprintf(stderr, "checksum: %ld\n", sum);
+
+	return mismatch ? -1 : 0;
+}
@@ -0,0 +1,375 @@
+/*
+ * Benchmark harness of beep_melody:
+ * - parse throughput on melody library file and on synthetic melody,
+ * - render speed of synthetic melody to WAV, relative to real time,
+ * - cold start latency: from fork/exec of beep_melody to its first
+ *   tone, timestamped by the file backend,
+ * - playback jitter: timing report of synthetic melody played at
+ *   several tempos on a virtual device: uinput, if /dev/uinput is
+ *   writable, or the file backend writing events to /dev/null.
+ *
+ * Results are printed as "key: value" lines, one per metric.
+ *
+ * Usage: ./bench_run [FILE [BEEP_MELODY]] -- melodies file
+ *   (beep_melody.txt) and binary to run (./beep_melody)
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <linux/input.h>
+
+#include "rtttl.h"
+#include "render.h"
+
+#define PARSE_SEC 0.5
+#define COLD_RUNS 20
+#define SYNTH_NOTES 10000
+#define JITTER_NOTES 32
+#define JITTER_UINPUT "/dev/uinput"
+
+static const char *synth_notes[] = {
+	"4d.6", "c6", "a#", "a", "4g", "g", "8e#6", "16p", "8c#7", "16g#6",
+	"4c.", "2f#.", "g.", "8d.6", "4c#6", "b.", "c#.6", "32b5", "16a",
+};
+
+/* Notes of default (short) duration, so playback is fast */
+static const char *jitter_notes[] = { "c", "e", "g", "c6", "p", "g", "e" };
+static const int jitter_tempos[] = { 40, 120, 200 };
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+struct span {
+	const char *s;
+	int len;
+};
+
+static double now_sec(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static char *read_file(const char *path, long *size)
+{
+	FILE *f;
+	char *buf;
+
+	if (!(f = fopen(path, "r")))
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	rewind(f);
+	buf = malloc(*size + 1);
+	if (buf && fread(buf, 1, *size, f) != *size) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	if (buf)
+		buf[*size] = '\0';
+	return buf;
+}
+
+/* Split file to melodies: one per line, maybe in double quotes */
+static int split_melodies(char *data, struct span *m, int max)
+{
+	char *s, *q;
+	int n = 0;
+
+	for (s = strtok(data, "\n"); s && n < max; s = strtok(NULL, "\n")) {
+		while (isspace(*s))
+			s++;
+		q = s + strlen(s);
+		while (q > s && isspace(q[-1]))
+			q--;
+		if (q - s >= 2 && *s == '"' && q[-1] == '"') {
+			s++;
+			q--;
+		}
+		if (q > s) {
+			m[n].s = s;
+			m[n++].len = q - s;
+		}
+	}
+	return n;
+}
+
+/* Return: melody of @n notes from @notes, caller must free it */
+static char *synth_melody(int n, const char *defaults, const char **notes,
+  int n_notes)
+{
+	size_t len = strlen(defaults) + n * 8 + 16;
+	char *m, *p;
+	int i;
+
+	if (!(m = malloc(len)))
+		return NULL;
+	p = m + sprintf(m, "Synth:%s:", defaults);
+	for (i = 0; i < n; i++)
+		p += sprintf(p, "%s%s", i ? "," : "", notes[i % n_notes]);
+	return m;
+}
+
+/*
+ * Compile melodies @m for about PARSE_SEC seconds and print
+ * throughput with @prefix.
+ */
+static int bench_parse(const char *prefix, const struct span *m, int n)
+{
+	struct parser ps;
+	struct note_event *ev;
+	long rounds = 0, notes = 0, bytes = 0;
+	double t, sec;
+	int i, n_ev;
+
+	parser_init(&ps, 0, NULL, 0);
+	t = now_sec();
+	do {
+		for (i = 0; i < n; i++) {
+			if (compile_span(&ps, m[i].s, m[i].len, &ev, &n_ev))
+				return -1;
+			free(ev);
+			notes += n_ev;
+			bytes += m[i].len;
+		}
+		rounds++;
+	} while ((sec = now_sec() - t) < PARSE_SEC);
+
+	printf("%s_melodies_per_sec: %.0f\n", prefix, rounds * n / sec);
+	printf("%s_notes_per_sec: %.0f\n", prefix, notes / sec);
+	printf("%s_mb_per_sec: %.2f\n", prefix, bytes / sec / 1e6);
+	return 0;
+}
+
+/* Render melody @m to /dev/null and print speed */
+static int bench_render(const char *m)
+{
+	struct renderer r;
+	struct parser ps;
+	struct note_event *ev = NULL;
+	double t, sec;
+	int n;
+
+	parser_init(&ps, 0, NULL, 0);
+	if (compile(&ps, m, &ev, &n) || render_open(&r, "/dev/null", RENDER_RATE)) {
+		free(ev);
+		return -1;
+	}
+	t = now_sec();
+	if (render_events(&r, ev, n)) {
+		render_close(&r);
+		free(ev);
+		return -1;
+	}
+	sec = now_sec() - t;
+	free(ev);
+
+	printf("render_msamples_per_sec: %.1f\n", r.n_samples / sec / 1e6);
+	printf("render_x_realtime: %.0f\n", r.n_samples / (double)RENDER_RATE
+	  / sec);
+	return render_close(&r);
+}
+
+/*
+ * Run @bin with @argv, feed @melody to its stdin and return pipe
+ * connected to its stdout (@out) or stderr (@err).
+ *
+ * Return: pid, <0 -- error,
+ */
+static pid_t spawn(const char *bin, char *const argv[], const char *melody,
+  int *out, int *err)
+{
+	int in[2], res[2];
+	pid_t pid;
+
+	if (pipe(in) || pipe(res))
+		return -1;
+	if ((pid = fork()) < 0)
+		return -1;
+	if (!pid) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(res[1], out ? STDOUT_FILENO : STDERR_FILENO);
+		close(in[0]);
+		close(in[1]);
+		close(res[0]);
+		close(res[1]);
+		execv(bin, argv);
+		_exit(127);
+	}
+	close(in[0]);
+	close(res[1]);
+	write(in[1], melody, strlen(melody));
+	close(in[1]);
+	*(out ? out : err) = res[0];
+	return pid;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int bench_cold_start(const char *bin)
+{
+	char *argv[] = { (char *)bin, "-B", "file:-", NULL };
+	struct input_event ev;
+	struct timespec t0;
+	long lat[COLD_RUNS];
+	int i, out, status;
+	pid_t pid;
+
+	for (i = 0; i < COLD_RUNS; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		pid = spawn(bin, argv, "Bench:d=32,o=5,b=200:c\n", &out, NULL);
+		if (pid < 0)
+			return -1;
+		if (read(out, &ev, sizeof(ev)) != sizeof(ev)) {
+			close(out);
+			waitpid(pid, &status, 0);
+			return -1;
+		}
+		close(out);
+		waitpid(pid, &status, 0);
+		lat[i] = (ev.input_event_sec - t0.tv_sec) * 1000000
+		  + ev.input_event_usec - t0.tv_nsec / 1000;
+	}
+
+	qsort(lat, COLD_RUNS, sizeof(lat[0]), cmp_long);
+	printf("cold_start_min_usec: %ld\n", lat[0]);
+	printf("cold_start_p50_usec: %ld\n", lat[COLD_RUNS / 2]);
+	printf("cold_start_max_usec: %ld\n", lat[COLD_RUNS - 1]);
+	return 0;
+}
+
+/*
+ * Check "write: INDEX DEADLINE ACTUAL LATENESS_USEC" line of timing
+ * report: indices go in order, lateness is ACTUAL - DEADLINE (in usec,
+ * rounded, 0 if early).
+ * In: @line -- line after "write: ", @index -- expected index
+ * Return: 0 -- ok, -1 -- malformed line
+ */
+static int check_write(const char *line, long index)
+{
+	long i, ds, dns, as, ans, late, want;
+
+	if (sscanf(line, "%ld %ld.%ld %ld.%ld %ld", &i, &ds, &dns, &as, &ans,
+	  &late) != 6 || i != index)
+		return -1;
+	want = (as - ds) * 1000000 + (ans - dns) / 1000;
+	if (want < 0)
+		want = 0;
+	return late >= 0 && labs(late - want) <= 1 ? 0 : -1;
+}
+
+/*
+ * Print timing report summary of beep_melody played on @backend at
+ * tempo @bpm with "playback_b<BPM>_" prefix. Per-write lines are not
+ * printed but checked against "writes:" count.
+ */
+static int bench_jitter(const char *bin, const char *backend, int bpm)
+{
+	char *argv[] = { (char *)bin, "-B", (char *)backend, "--timing-report",
+	  NULL };
+	char line[256], defaults[32], *melody;
+	int err, status, n = 0, bad = 0;
+	long writes = -1, listed = 0;
+	FILE *f;
+	pid_t pid;
+
+	snprintf(defaults, sizeof(defaults), "d=32,o=5,b=%d", bpm);
+	if (!(melody = synth_melody(JITTER_NOTES, defaults, jitter_notes,
+	  ARRAY_SIZE(jitter_notes))))
+		return -1;
+	pid = spawn(bin, argv, melody, NULL, &err);
+	free(melody);
+	if (pid < 0)
+		return -1;
+
+	f = fdopen(err, "r");
+	while (fgets(line, sizeof(line), f)) {
+		/* Skip log messages, if any */
+		if (!islower(*line) || !strchr(line, ':'))
+			continue;
+		if (!strncmp(line, "write: ", 7)) {
+			if (check_write(line + 7, listed++)) {
+				fprintf(stderr, "Bad timing line: %s", line);
+				bad = 1;
+			}
+			continue;
+		}
+		if (!strncmp(line, "writes: ", 8))
+			writes = atol(line + 8);
+		printf("playback_b%d_%s", bpm, line);
+		n++;
+	}
+	fclose(f);
+	waitpid(pid, &status, 0);
+
+	if (writes != listed) {
+		fprintf(stderr, "Timing report lists %ld of %ld writes\n",
+		  listed, writes);
+		bad = 1;
+	}
+	return n && !bad && WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "beep_melody.txt";
+	const char *bin = argc > 2 ? argv[2] : "./beep_melody";
+	const char *backend;
+	static struct span m[1024];
+	struct span synth;
+	char *data, *s;
+	long size;
+	size_t i;
+	int n;
+
+	if (!(data = read_file(path, &size))) {
+		fprintf(stderr, "Failed to read \"%s\": %s\n", path,
+		  strerror(errno));
+		return -1;
+	}
+	n = split_melodies(data, m, ARRAY_SIZE(m));
+	if (!n || bench_parse("parse_file", m, n)) {
+		fprintf(stderr, "Failed to compile melodies of \"%s\"\n", path);
+		return -1;
+	}
+
+	if (!(s = synth_melody(SYNTH_NOTES, "d=8,o=5,b=125", synth_notes,
+	  ARRAY_SIZE(synth_notes))))
+		return -1;
+	synth.s = s;
+	synth.len = strlen(s);
+	if (bench_parse("parse_synth", &synth, 1) || bench_render(s))
+		return -1;
+	free(s);
+	free(data);
+
+	if (bench_cold_start(bin)) {
+		fprintf(stderr, "Failed to measure cold start of \"%s\"\n", bin);
+		return -1;
+	}
+	backend = access(JITTER_UINPUT, W_OK) ? "file:/dev/null" : "uinput";
+	for (i = 0; i < ARRAY_SIZE(jitter_tempos); i++) {
+		if (bench_jitter(bin, backend, jitter_tempos[i])) {
+			fprintf(stderr, "Failed to measure playback of \"%s\" "
+			  "on \"%s\" at b=%d\n", bin, backend, jitter_tempos[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
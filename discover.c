@@ -0,0 +1,213 @@
+/*
+ * Discovery of beepers.
+ *
+ * State file format (text):
+ *   dir <mtime sec> <mtime nsec>
+ *   dev <path> <rdev> <bustype> <vendor> <product> <version> <name>
+ *
+ * State file may be in a shared directory (/tmp), so it is trusted
+ * only if it is a regular file of this user, not writable by others,
+ * and only with paths of event devices in DISCOVER_DIR.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+
+#include "discover.h"
+
+static void cache_path(char *path, size_t size)
+{
+	const char *s;
+
+	if ((s = getenv("BEEP_DEVICE_CACHE")) && *s)
+		snprintf(path, size, "%s", s);
+	else if ((s = getenv("XDG_RUNTIME_DIR")) && *s)
+		snprintf(path, size, "%s/beep-devices", s);
+	else
+		snprintf(path, size, "/tmp/beep-devices-%u", getuid());
+}
+
+/*
+ * Query device @path.
+ *
+ * Return: 1 -- it is a beeper, 0 -- it isn't (or can't be opened),
+ */
+static int probe(const char *path, struct snd_device *dev)
+{
+	struct stat st;
+	int fd, ok = 0;
+
+	/* Beepers are often writable only, ioctl() works for both modes */
+	if ((fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0
+	  && (fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		return 0;
+
+	if (!snd_tone_supported(fd) || fstat(fd, &st))
+		goto out;
+
+	memset(dev, 0, sizeof(*dev));
+	snprintf(dev->path, sizeof(dev->path), "%s", path);
+	dev->rdev = st.st_rdev;
+	ioctl(fd, EVIOCGID, &dev->id);
+	if (ioctl(fd, EVIOCGNAME(sizeof(dev->name) - 1), dev->name) < 0)
+		strcpy(dev->name, "?");
+	ok = 1;
+
+out:
+	close(fd);
+	return ok;
+}
+
+static int cmp_dev(const void *a, const void *b)
+{
+	const struct snd_device *x = a, *y = b;
+	size_t lx = strlen(x->path), ly = strlen(y->path);
+
+	/* event2 < event10 */
+	return lx != ly ? (lx < ly ? -1 : 1) : strcmp(x->path, y->path);
+}
+
+static int scan(struct snd_device *dev, int max)
+{
+	char path[sizeof(dev->path)];
+	struct dirent *de;
+	DIR *d;
+	int n = 0;
+
+	if (!(d = opendir(DISCOVER_DIR)))
+		return -1;
+	while ((de = readdir(d)) && n < max) {
+		if (strncmp(de->d_name, "event", 5))
+			continue;
+		if (snprintf(path, sizeof(path), DISCOVER_DIR "/%s", de->d_name)
+		  >= sizeof(path))
+			continue;
+		n += probe(path, &dev[n]);
+	}
+	closedir(d);
+
+	qsort(dev, n, sizeof(*dev), cmp_dev);
+	return n;
+}
+
+/* Return: 1 -- @path is DISCOVER_DIR/<name> of character device */
+static int event_path(const char *path, struct stat *st)
+{
+	const char *name = path + strlen(DISCOVER_DIR "/");
+
+	return !strncmp(path, DISCOVER_DIR "/", strlen(DISCOVER_DIR "/"))
+	  && *name && !strchr(name, '/') && strcmp(name, "..")
+	  && !lstat(path, st) && S_ISCHR(st->st_mode);
+}
+
+/*
+ * Read cache, if it is valid for directory @st.
+ *
+ * Return: number of devices, <0 -- no valid cache,
+ */
+static int cache_read(const char *path, const struct stat *st,
+  struct snd_device *dev, int max)
+{
+	char line[256], *name;
+	unsigned long rdev;
+	unsigned int id[4];
+	long sec, nsec;
+	struct stat dst;
+	FILE *f;
+	int fd, n = 0, valid;
+
+	if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+		return -1;
+	/* Planted by someone else, e.g. in /tmp */
+	if (fstat(fd, &dst) || !S_ISREG(dst.st_mode) || dst.st_uid != getuid()
+	  || dst.st_mode & (S_IWGRP | S_IWOTH) || !(f = fdopen(fd, "r"))) {
+		close(fd);
+		return -1;
+	}
+	valid = fgets(line, sizeof(line), f)
+	  && sscanf(line, "dir %ld %ld", &sec, &nsec) == 2
+	  && sec == st->st_mtim.tv_sec && nsec == st->st_mtim.tv_nsec;
+
+	while (valid && n < max && fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		memset(&dev[n], 0, sizeof(dev[n]));
+		name = NULL;
+		if (sscanf(line, "dev %63s %lu %x %x %x %x", dev[n].path,
+		  &rdev, &id[0], &id[1], &id[2], &id[3]) != 6
+		  || !(name = strchr(line, '\t'))) {
+			valid = 0;
+			break;
+		}
+		/* Device node in DISCOVER_DIR must be the same device */
+		if (!event_path(dev[n].path, &dst) || dst.st_rdev != rdev) {
+			valid = 0;
+			break;
+		}
+		dev[n].rdev = rdev;
+		dev[n].id.bustype = id[0];
+		dev[n].id.vendor = id[1];
+		dev[n].id.product = id[2];
+		dev[n].id.version = id[3];
+		snprintf(dev[n].name, sizeof(dev[n].name), "%s", name + 1);
+		n++;
+	}
+	fclose(f);
+
+	return valid ? n : -1;
+}
+
+/* Write cache, replacing it atomically */
+static void cache_write(const char *path, const struct stat *st,
+  const struct snd_device *dev, int n)
+{
+	char tmp[4096];
+	FILE *f;
+	int i, fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= sizeof(tmp))
+		return;
+	if ((fd = mkstemp(tmp)) < 0)
+		return;
+	if (!(f = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	fprintf(f, "dir %ld %ld\n", (long)st->st_mtim.tv_sec,
+	  (long)st->st_mtim.tv_nsec);
+	for (i = 0; i < n; i++) {
+		fprintf(f, "dev %s %lu %04x %04x %04x %04x\t%s\n", dev[i].path,
+		  (unsigned long)dev[i].rdev, dev[i].id.bustype,
+		  dev[i].id.vendor, dev[i].id.product, dev[i].id.version,
+		  dev[i].name);
+	}
+	if (fclose(f) || rename(tmp, path))
+		unlink(tmp);
+}
+
+int discover_devices(struct snd_device *dev, int max, int refresh)
+{
+	char path[4096];
+	struct stat st;
+	int n;
+
+	if (stat(DISCOVER_DIR, &st))
+		return -1;
+	cache_path(path, sizeof(path));
+	if (!refresh && (n = cache_read(path, &st, dev, max)) >= 0)
+		return n;
+
+	if ((n = scan(dev, max)) < 0)
+		return -1;
+	cache_write(path, &st, dev, n);
+	return n;
+}
@@ -0,0 +1,57 @@
+/*
+ * Discovery of beepers: event devices which support EV_SND/SND_TONE.
+ *
+ * Scan of /dev/input opens every event device, so its result is kept
+ * in a state file. The cache is used while /dev/input isn't changed
+ * and every cached device node keeps its identity (device number),
+ * otherwise devices are scanned again and the cache is rewritten.
+ *
+ * State file is $BEEP_DEVICE_CACHE, $XDG_RUNTIME_DIR/beep-devices or
+ * /tmp/beep-devices-UID.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#ifndef DISCOVER_H
+#define DISCOVER_H
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+#define DISCOVER_DIR "/dev/input"
+#define DISCOVER_MAX 64
+
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define test_bit(bit, a) ((a)[(bit) / BITS_PER_LONG] \
+	>> ((bit) % BITS_PER_LONG) & 1)
+
+/* Return: 1 -- event device @fd is a beeper (EV_SND/SND_TONE), 0 -- no */
+static inline int snd_tone_supported(int fd)
+{
+	unsigned long ev_bits[EV_MAX / BITS_PER_LONG + 1] = { 0 };
+	unsigned long snd_bits[SND_MAX / BITS_PER_LONG + 1] = { 0 };
+
+	return ioctl(fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits) >= 0
+	  && test_bit(EV_SND, ev_bits)
+	  && ioctl(fd, EVIOCGBIT(EV_SND, sizeof(snd_bits)), snd_bits) >= 0
+	  && test_bit(SND_TONE, snd_bits);
+}
+
+struct snd_device {
+	char path[64];
+	dev_t rdev;
+	struct input_id id;
+	char name[64];
+};
+
+/*
+ * Find beepers, cached result is used if it is still valid and
+ * @refresh isn't set. Devices are sorted by path.
+ *
+ * Out: @dev -- room for @max devices,
+ * Return: number of devices, <0 -- error (see errno),
+ */
+int discover_devices(struct snd_device *dev, int max, int refresh);
+
+#endif
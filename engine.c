@@ -0,0 +1,292 @@
+/*
+ * Playback engine.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "engine.h"
+
+#define ENGINE_MAX_EVENTS 64
+
+static inline int before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec
+	  || a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec;
+}
+
+static int arm(struct voice *v, const struct timespec *t)
+{
+	struct itimerspec its = { .it_value = *t };
+
+	/* Zero value would disarm timer */
+	if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+		its.it_value.tv_nsec = 1;
+	return timerfd_settime(v->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * Start the next lap of looped voice @v at the end of the current one.
+ *
+ * Return: 1 -- started, 0 -- the last lap is played,
+ */
+static int voice_wrap(struct voice *v, int n)
+{
+	if (!n || v->loops != VOICE_FOREVER && v->lap + 1 >= v->loops)
+		return 0;
+	v->lap++;
+	v->i = 0;
+	v->prev_lap_t = v->lap_t;
+	v->lap_t = v->t;
+	return 1;
+}
+
+/*
+ * Find the next tone change of voice: the same schedule as beep_melody
+ * plays, pauses and repeated tones aren't changes. Sets @v->deadline
+ * and @v->next_freq, or @v->ending if only the end of melody is left.
+ * Events appended by engine_append() are played on the same schedule,
+ * until the voice is ending. Looped voice wraps to event 0, one call
+ * scans at most a lap, so the tone heard is never more than one lap
+ * behind @v->lap.
+ */
+static void voice_next(struct engine *e, struct voice *v)
+{
+	const struct note_event *ev;
+	int n, same = 0;
+
+again:
+	v->off_at_end = 0;
+	for (;;) {
+		n = __atomic_load_n(&v->n_events, __ATOMIC_ACQUIRE);
+		if (v->i >= n && !voice_wrap(v, n))
+			break;
+		ev = &v->events[v->i++];
+		v->deadline = v->t;
+		timespec_add_usec(&v->t, ev->duration_usec);
+		if (ev->freq != v->next_freq || ++same >= n - 1) {
+			v->next_freq = ev->freq;
+			return;
+		}
+	}
+
+	v->deadline = v->t;
+	if (v->next_freq) {
+		v->next_freq = 0;
+		v->off_at_end = 1;
+		return;
+	}
+	pthread_mutex_lock(&e->lock);
+	if (v->i < v->n_events) {
+		pthread_mutex_unlock(&e->lock);
+		goto again;
+	}
+	v->ending = 1;
+	pthread_mutex_unlock(&e->lock);
+}
+
+/*
+ * Find when to stop voice for @v->stop requested at @now and the
+ * first event to resume with.
+ */
+static void plan_stop(struct voice *v, const struct timespec *now)
+{
+	struct timespec t = v->lap_t, next;
+	int k, lap = v->lap, n = __atomic_load_n(&v->n_events, __ATOMIC_ACQUIRE);
+
+	/* Tone of the previous lap may still sound */
+	if (lap && before(now, &t)) {
+		lap--;
+		t = v->prev_lap_t;
+	}
+	for (k = lap ? 0 : v->first; k < n; k++) {
+		next = t;
+		timespec_add_usec(&next, v->events[k].duration_usec);
+		if (before(now, &next))
+			break;
+		t = next;
+	}
+
+	/* Event k sounds now, it ends at next */
+	if (v->stop == VOICE_STOP_NOW || k == n) {
+		v->stop_at = *now;
+		v->resume = k;
+	} else {
+		v->stop_at = next;
+		v->resume = k + 1;
+	}
+	v->resume_lap = lap;
+	v->stop_planned = v->stop;
+}
+
+static void voice_finish(struct engine *e, struct voice *v, int status)
+{
+	if (v->freq)
+		backend_tone(v->be, 0);
+
+	pthread_mutex_lock(&e->lock);
+	v->finished = 1;
+	epoll_ctl(e->epfd, EPOLL_CTL_DEL, v->tfd, NULL);
+	close(v->tfd);
+	pthread_mutex_unlock(&e->lock);
+
+	if (v->done)
+		v->done(v, status, v->arg);
+}
+
+/* Timer of voice expired: it is its deadline or stop was requested */
+static void voice_fire(struct engine *e, struct voice *v)
+{
+	struct timespec now, at;
+	uint64_t n;
+	int stop, err;
+
+	read(v->tfd, &n, sizeof(n));
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((stop = __atomic_load_n(&v->stop, __ATOMIC_ACQUIRE))
+	  && stop != v->stop_planned)
+		plan_stop(v, &now);
+	if (v->stop_planned && !before(&now, &v->stop_at)) {
+		voice_finish(e, v, -ECANCELED);
+		return;
+	}
+	/* Woken up by stop request */
+	if (before(&now, &v->deadline))
+		goto rearm;
+
+	if (v->ending) {
+		v->resume = v->n_events;
+		v->resume_lap = v->lap;
+		voice_finish(e, v, 0);
+		return;
+	}
+
+	/* Events appended after the end was planned go on without a gap */
+	if (v->off_at_end
+	  && v->i < __atomic_load_n(&v->n_events, __ATOMIC_ACQUIRE)) {
+		v->next_freq = v->freq;
+		voice_next(e, v);
+		goto rearm;
+	}
+
+	if (backend_tone(v->be, v->next_freq)) {
+		voice_finish(e, v, -errno);
+		return;
+	}
+	v->freq = v->next_freq;
+	if (e->on_write)
+		e->on_write(v, &v->deadline);
+
+	voice_next(e, v);
+
+rearm:
+	at = v->deadline;
+	if (v->stop_planned && before(&v->stop_at, &at))
+		at = v->stop_at;
+	/* Don't override timer armed by concurrent stop */
+	pthread_mutex_lock(&e->lock);
+	err = v->stop != v->stop_planned ? 0 : arm(v, &at);
+	pthread_mutex_unlock(&e->lock);
+	if (err)
+		voice_finish(e, v, -errno);
+}
+
+int engine_init(struct engine *e)
+{
+	memset(e, 0, sizeof(*e));
+	if ((e->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return -1;
+	pthread_mutex_init(&e->lock, NULL);
+	return 0;
+}
+
+void engine_destroy(struct engine *e)
+{
+	close(e->epfd);
+	pthread_mutex_destroy(&e->lock);
+}
+
+int engine_submit(struct engine *e, struct voice *v,
+  const struct timespec *start)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = v };
+	int err;
+
+	v->i = v->first;
+	v->freq = v->next_freq = 0;
+	v->ending = v->off_at_end = v->stop = v->stop_planned = v->finished = 0;
+	v->lap = v->resume = v->resume_lap = 0;
+	if (start)
+		v->t = *start;
+	else
+		clock_gettime(CLOCK_MONOTONIC, &v->t);
+	v->lap_t = v->t;
+	voice_next(e, v);
+
+	if ((v->tfd = timerfd_create(CLOCK_MONOTONIC,
+	  TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+		return -1;
+	/* Timer is armed before epoll sees it, so the voice is ready */
+	if (arm(v, &v->deadline) || epoll_ctl(e->epfd, EPOLL_CTL_ADD, v->tfd,
+	  &ev)) {
+		err = errno;
+		close(v->tfd);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int engine_append(struct engine *e, struct voice *v, int n_events)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&e->lock);
+	if (v->ending || v->finished)
+		err = -1;
+	else
+		__atomic_store_n(&v->n_events, n_events, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&e->lock);
+	return err;
+}
+
+void engine_stop(struct engine *e, struct voice *v, int how)
+{
+	struct timespec now;
+
+	pthread_mutex_lock(&e->lock);
+	if (!v->finished && how > v->stop) {
+		__atomic_store_n(&v->stop, how, __ATOMIC_RELEASE);
+		/* Fire at once */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		arm(v, &now);
+	}
+	pthread_mutex_unlock(&e->lock);
+}
+
+int engine_run_once(struct engine *e, int timeout_ms)
+{
+	struct epoll_event ev[ENGINE_MAX_EVENTS];
+	int i, n;
+
+	n = epoll_wait(e->epfd, ev, ENGINE_MAX_EVENTS, timeout_ms);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+	for (i = 0; i < n; i++)
+		voice_fire(e, ev[i].data.ptr);
+	return 0;
+}
+
+int engine_run(struct engine *e)
+{
+	while (!engine_run_once(e, -1))
+		;
+	return -1;
+}
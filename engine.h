@@ -0,0 +1,162 @@
+/*
+ * Playback engine: one thread plays any number of melodies on any
+ * number of backends. Every melody (voice) has its own timerfd armed
+ * to the absolute deadline of its next tone change, all timers are
+ * waited for with a single epoll.
+ *
+ * Voices may be submitted and cancelled from any thread, all other
+ * work, including completion callbacks, is done by the thread which
+ * runs engine_run().
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "rtttl.h"
+#include "backend.h"
+
+/*
+ * Sleep until absolute CLOCK_MONOTONIC time @t. Signals don't cut
+ * the sleep short, unless their handler sets *@stop (may be NULL).
+ *
+ * Return: 0 -- Ok, <0 -- stopped,
+ */
+static inline int sleep_until(const struct timespec *t,
+  const volatile sig_atomic_t *stop)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, t, NULL)
+	  == EINTR) {
+		if (stop && *stop)
+			return -1;
+	}
+	return 0;
+}
+
+/* Move deadline @t by @usec, shared by all players */
+static inline void timespec_add_usec(struct timespec *t, int usec)
+{
+	t->tv_sec += usec / 1000000;
+	t->tv_nsec += (usec % 1000000) * 1000;
+	if (t->tv_nsec >= 1000000000) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000;
+	}
+}
+
+struct voice;
+
+enum voice_stops {
+	VOICE_PLAY=0,
+	VOICE_STOP_NOTE, /* At the onset of the next note */
+	VOICE_STOP_NOW,
+};
+
+#define VOICE_FOREVER TRANSFORM_LOOP_FOREVER /* @loops: until stopped */
+
+/*
+ * Called by engine thread when voice ends. Engine doesn't touch
+ * the voice after this call, so it may be freed here.
+ *
+ * In: @status -- 0 -- played to the end, -ECANCELED -- stopped,
+ *   other <0 -- backend error. @v->resume is index of the first
+ *   event, which wasn't played (or was interrupted), in lap
+ *   @v->resume_lap (0 -- the first one),
+ */
+typedef void (*voice_done_cb)(struct voice *v, int status, void *arg);
+
+struct voice {
+	/* Set by caller */
+	struct backend *be;
+	const struct note_event *events;
+	int n_events;
+	int first;          /* Event to start with, laps after the first one
+	                       start with 0 */
+	int loops;          /* Laps to play: 0, 1 -- once, VOICE_FOREVER */
+	voice_done_cb done;
+	void *arg;
+
+	/* Engine state */
+	int tfd;
+	int i;              /* Next event */
+	int freq;           /* Tone set on backend */
+	int next_freq;      /* Tone to set at deadline */
+	int ending;         /* Deadline is the end of melody */
+	int off_at_end;     /* Tone off at deadline is the end of events */
+	int stop;           /* Requested stop (enum voice_stops) */
+	int stop_planned;   /* Stop, for which @stop_at is found */
+	int finished;
+	int lap;            /* Lap of event @i */
+	int resume;
+	int resume_lap;
+	struct timespec lap_t;      /* Start of lap @lap */
+	struct timespec prev_lap_t; /* Start of lap before it */
+	struct timespec t;  /* Time of the next event */
+	struct timespec deadline;
+	struct timespec stop_at;
+};
+
+struct engine {
+	int epfd;
+	pthread_mutex_t lock; /* Protects cancel vs. finish of voices */
+
+	/* Called after every backend write (may be NULL) */
+	void (*on_write)(struct voice *v, const struct timespec *deadline);
+};
+
+/* Return: 0 -- Ok, <0 -- error (see errno), */
+int engine_init(struct engine *e);
+
+void engine_destroy(struct engine *e);
+
+/*
+ * Start playback of voice @v. Thread safe.
+ *
+ * In: @start -- absolute CLOCK_MONOTONIC time of the first note,
+ *   NULL -- now,
+ * Return: 0 -- Ok, <0 -- error (see errno), callback isn't called,
+ */
+int engine_submit(struct engine *e, struct voice *v,
+  const struct timespec *start);
+
+/*
+ * Extend playing voice @v to @n_events: events appended to the array
+ * (which must have room for them) are played after the current ones
+ * on the same schedule. Not for looped voices. Thread safe.
+ *
+ * Return: 0 -- Ok, <0 -- voice is ending or has finished, appended
+ *   events won't be played,
+ */
+int engine_append(struct engine *e, struct voice *v, int n_events);
+
+/*
+ * Stop voice @v at once (VOICE_STOP_NOW) or when the note being
+ * played ends (VOICE_STOP_NOTE), its callback gets -ECANCELED.
+ * Stop may be made earlier by the second call. Nothing is done
+ * if the voice has already finished. Thread safe.
+ */
+void engine_stop(struct engine *e, struct voice *v, int how);
+
+static inline void engine_cancel(struct engine *e, struct voice *v)
+{
+	engine_stop(e, v, VOICE_STOP_NOW);
+}
+
+/*
+ * Handle expired timers, wait for them at most @timeout_ms
+ * (-1 -- forever).
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+int engine_run_once(struct engine *e, int timeout_ms);
+
+/* Run engine loop until error */
+int engine_run(struct engine *e);
+
+#endif
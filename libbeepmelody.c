@@ -0,0 +1,177 @@
+/*
+ * libbeepmelody: compile RTTTL melodies and play them in background.
+ *
+ * All melodies are played by one internal thread running the playback
+ * engine, it is started on the first bm_play_async() call.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "beepmelody.h"
+#include "rtttl.h"
+#include "backend.h"
+#include "engine.h"
+
+struct bm_player {
+	struct voice voice;
+	struct backend be;
+	struct note_event *events;
+	bm_done_cb cb;
+	void *arg;
+	int status;
+	int fd; /* eventfd, signalled when playback ends */
+};
+
+static struct engine engine;
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+static int engine_err;
+
+int bm_compile(const char *melody, struct note_event **events, int *n_events,
+  char *err, int err_size)
+{
+	struct parser ps;
+
+	if (err && err_size)
+		*err = '\0';
+	parser_init(&ps, 0, err, err_size);
+	return compile(&ps, melody, events, n_events);
+}
+
+int bm_transform(const struct note_event *events, int n_events,
+  int semitones, int tempo_pct, struct note_event **out)
+{
+	struct transform xf = {
+		.semitones = semitones,
+		.tempo_pct = tempo_pct,
+	};
+
+	return transform_events(&xf, default_tuning, events, n_events, out);
+}
+
+static void *engine_thread(void *arg)
+{
+	engine_run(&engine);
+	return NULL;
+}
+
+static void engine_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+
+	if (engine_init(&engine)) {
+		engine_err = errno;
+		return;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if ((engine_err = pthread_create(&tid, &attr, engine_thread, NULL)))
+		engine_destroy(&engine);
+	pthread_attr_destroy(&attr);
+}
+
+/* Called on engine thread */
+static void play_done(struct voice *v, int status, void *arg)
+{
+	struct bm_player *p = arg;
+	uint64_t one = 1;
+
+	backend_close(&p->be);
+	p->status = status;
+	if (p->cb)
+		p->cb(p, status, p->arg);
+	write(p->fd, &one, sizeof(one));
+}
+
+struct bm_player *bm_play_loop(const char *backend,
+  const struct note_event *events, int n_events, int loops, bm_done_cb cb,
+  void *arg)
+{
+	struct bm_player *p;
+	int err;
+
+	pthread_once(&engine_once, engine_start);
+	if (engine_err) {
+		errno = engine_err;
+		return NULL;
+	}
+
+	if (loops < BM_LOOP_FOREVER) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!(p = calloc(1, sizeof(*p))))
+		return NULL;
+	p->fd = -1;
+	p->cb = cb;
+	p->arg = arg;
+	if (!(p->events = malloc(n_events * sizeof(*events) + 1)))
+		goto err;
+	memcpy(p->events, events, n_events * sizeof(*events));
+
+	if ((p->fd = eventfd(0, EFD_CLOEXEC)) < 0)
+		goto err;
+	if (backend_open(&p->be, backend))
+		goto err;
+
+	p->voice.be = &p->be;
+	p->voice.events = p->events;
+	p->voice.n_events = n_events;
+	p->voice.loops = loops == BM_LOOP_FOREVER ? VOICE_FOREVER : loops;
+	p->voice.done = play_done;
+	p->voice.arg = p;
+	if (engine_submit(&engine, &p->voice, NULL)) {
+		backend_close(&p->be);
+		goto err;
+	}
+	return p;
+
+err:
+	err = errno;
+	if (p->fd >= 0)
+		close(p->fd);
+	free(p->events);
+	free(p);
+	errno = err;
+	return NULL;
+}
+
+struct bm_player *bm_play_async(const char *backend,
+  const struct note_event *events, int n_events, bm_done_cb cb, void *arg)
+{
+	return bm_play_loop(backend, events, n_events, 1, cb, arg);
+}
+
+void bm_cancel(struct bm_player *p)
+{
+	engine_cancel(&engine, &p->voice);
+}
+
+int bm_fd(const struct bm_player *p)
+{
+	return p->fd;
+}
+
+int bm_wait(struct bm_player *p)
+{
+	uint64_t n;
+	int status;
+
+	while (read(p->fd, &n, sizeof(n)) < 0 && errno == EINTR)
+		;
+	status = p->status;
+	close(p->fd);
+	free(p->events);
+	free(p);
+
+	return status;
+}
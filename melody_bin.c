@@ -0,0 +1,157 @@
+/*
+ * Binary file of compiled melodies.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "melody_bin.h"
+
+int melody_bin_write(const char *path, const struct melody_bin_entry *e,
+  int n)
+{
+	struct melody_bin_header hdr;
+	struct melody_bin_index idx;
+	char tmp[4096];
+	FILE *f;
+	uint32_t first = 0;
+	int i, err;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (!(f = fopen(tmp, "wb")))
+		return -1;
+
+	memcpy(hdr.magic, MELODY_BIN_MAGIC, sizeof(hdr.magic));
+	hdr.version = MELODY_BIN_VERSION;
+	hdr.event_size = sizeof(struct note_event);
+	hdr.n_melodies = n;
+	hdr.n_events = 0;
+	for (i = 0; i < n; i++)
+		hdr.n_events += e[i].n_events;
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto err;
+
+	for (i = 0; i < n; i++) {
+		memset(&idx, 0, sizeof(idx));
+		strncpy(idx.name, e[i].name, sizeof(idx.name) - 1);
+		idx.first = first;
+		idx.n_events = e[i].n_events;
+		first += e[i].n_events;
+		if (fwrite(&idx, sizeof(idx), 1, f) != 1)
+			goto err;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (e[i].n_events && fwrite(e[i].events, sizeof(*e[i].events),
+		  e[i].n_events, f) != e[i].n_events)
+			goto err;
+	}
+
+	if (fflush(f) || fsync(fileno(f)))
+		goto err;
+	if (fclose(f)) {
+		f = NULL;
+		goto err;
+	}
+	if (rename(tmp, path)) {
+		f = NULL;
+		goto err;
+	}
+	return 0;
+
+err:
+	err = errno;
+	if (f)
+		fclose(f);
+	unlink(tmp);
+	errno = err;
+	return -1;
+}
+
+int melody_bin_open(const char *path, struct melody_bin *bin)
+{
+	const struct melody_bin_header *hdr;
+	struct stat st;
+	size_t size;
+	uint32_t i;
+	int fd;
+
+	memset(bin, 0, sizeof(*bin));
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < sizeof(*hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	bin->size = st.st_size;
+	bin->map = mmap(NULL, bin->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (bin->map == MAP_FAILED) {
+		bin->map = NULL;
+		return -1;
+	}
+
+	hdr = bin->map;
+	if (memcmp(hdr->magic, MELODY_BIN_MAGIC, sizeof(hdr->magic))
+	  || hdr->version != MELODY_BIN_VERSION
+	  || hdr->event_size != sizeof(struct note_event))
+		goto invalid;
+
+	size = sizeof(*hdr) + (size_t)hdr->n_melodies * sizeof(*bin->index)
+	  + (size_t)hdr->n_events * sizeof(*bin->events);
+	if (size != bin->size)
+		goto invalid;
+
+	bin->hdr = hdr;
+	bin->index = (const void *)(hdr + 1);
+	bin->events = (const void *)(bin->index + hdr->n_melodies);
+
+	for (i = 0; i < hdr->n_melodies; i++) {
+		if (bin->index[i].first > hdr->n_events
+		  || bin->index[i].n_events > hdr->n_events - bin->index[i].first
+		  || !memchr(bin->index[i].name, '\0', MELODY_MAX_NAME))
+			goto invalid;
+	}
+
+	return 0;
+
+invalid:
+	melody_bin_close(bin);
+	errno = EINVAL;
+	return -1;
+}
+
+const struct melody_bin_index *melody_bin_find(const struct melody_bin *bin,
+  const char *name)
+{
+	uint32_t i;
+
+	for (i = 0; i < bin->hdr->n_melodies; i++) {
+		if (!strcmp(bin->index[i].name, name))
+			return &bin->index[i];
+	}
+	return NULL;
+}
+
+void melody_bin_close(struct melody_bin *bin)
+{
+	if (bin->map)
+		munmap(bin->map, bin->size);
+	memset(bin, 0, sizeof(*bin));
+}
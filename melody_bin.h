@@ -0,0 +1,75 @@
+/*
+ * Binary file of compiled melodies. It may be mmap'ed and played
+ * at once, without parsing.
+ *
+ * File layout (native byte order):
+ *   struct melody_bin_header,
+ *   struct melody_bin_index[n_melodies] -- melodies in file order,
+ *   struct note_event[n_events] -- events of all melodies.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#ifndef MELODY_BIN_H
+#define MELODY_BIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rtttl.h"
+
+#define MELODY_BIN_MAGIC "BMLD"
+#define MELODY_BIN_VERSION 2 /* 2 -- pauses between notes are events */
+
+struct melody_bin_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t event_size; /* sizeof(struct note_event) */
+	uint32_t n_melodies;
+	uint32_t n_events;
+};
+
+struct melody_bin_index {
+	char name[MELODY_MAX_NAME];
+	uint32_t first; /* Index of the first melody event */
+	uint32_t n_events;
+};
+
+/* Melody to write */
+struct melody_bin_entry {
+	const char *name;
+	const struct note_event *events;
+	int n_events;
+};
+
+/* Mapped file */
+struct melody_bin {
+	void *map;
+	size_t size;
+	const struct melody_bin_header *hdr;
+	const struct melody_bin_index *index;
+	const struct note_event *events;
+};
+
+/*
+ * Write melodies to file @path. File is replaced atomically.
+ *
+ * Return: 0 -- Ok, <0 -- error (see errno),
+ */
+int melody_bin_write(const char *path, const struct melody_bin_entry *e,
+  int n);
+
+/*
+ * Map file @path and check its header and sizes.
+ *
+ * Return: 0 -- Ok, <0 -- error (see errno, EINVAL -- invalid file),
+ */
+int melody_bin_open(const char *path, struct melody_bin *bin);
+
+/* Return: melody @name or NULL */
+const struct melody_bin_index *melody_bin_find(const struct melody_bin *bin,
+  const char *name);
+
+void melody_bin_close(struct melody_bin *bin);
+
+#endif
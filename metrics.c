@@ -0,0 +1,49 @@
+/*
+ * Runtime metrics.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#include <stdio.h>
+
+#include "metrics.h"
+
+void hist_add(struct histogram *h, long usec)
+{
+	int i;
+
+	if (usec < 0)
+		usec = 0;
+	i = usec ? 64 - __builtin_clzl(usec) : 0;
+	if (i >= HIST_BUCKETS)
+		i = HIST_BUCKETS - 1;
+	counter_add(&h->bucket[i], 1);
+	counter_add(&h->sum, usec);
+}
+
+void metrics_print_value(FILE *f, const char *name, const char *type,
+  const char *help, double value)
+{
+	fprintf(f, "# HELP %s %s\n", name, help);
+	fprintf(f, "# TYPE %s %s\n", name, type);
+	fprintf(f, "%s %.15g\n", name, value);
+}
+
+void metrics_print_hist(FILE *f, const struct histogram *h)
+{
+	unsigned long n = 0;
+	int i;
+
+	fprintf(f, "# HELP %s %s\n", h->name, h->help);
+	fprintf(f, "# TYPE %s histogram\n", h->name);
+	/* The last bucket has no upper bound, it is +Inf */
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		n += counter_get(&h->bucket[i]);
+		fprintf(f, "%s_bucket{le=\"%ld\"} %lu\n", h->name,
+		  i ? (1L << i) - 1 : 0, n);
+	}
+	n += counter_get(&h->bucket[i]);
+	fprintf(f, "%s_bucket{le=\"+Inf\"} %lu\n", h->name, n);
+	fprintf(f, "%s_sum %lu\n", h->name, counter_get(&h->sum));
+	fprintf(f, "%s_count %lu\n", h->name, n);
+}
@@ -0,0 +1,49 @@
+/*
+ * Runtime metrics: counters and latency histograms, printed in
+ * Prometheus text format. Updates are relaxed atomic additions,
+ * so they may be done from any thread, playback one included,
+ * without locks.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+/*
+ * Histogram of usec values in log2 buckets: bucket i counts values
+ * in [2^(i-1), 2^i), bucket 0 -- 0 usec. The last one counts all
+ * greater values (over 2^22 usec, i.e. ~4 s).
+ */
+#define HIST_BUCKETS 24
+
+struct histogram {
+	const char *name;
+	const char *help;
+	unsigned long sum; /* usec */
+	unsigned long bucket[HIST_BUCKETS];
+};
+
+static inline void counter_add(unsigned long *c, unsigned long n)
+{
+	__atomic_fetch_add(c, n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long counter_get(const unsigned long *c)
+{
+	return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+/* Count value @usec (<0 is counted as 0) */
+void hist_add(struct histogram *h, long usec);
+
+/* Print counter or gauge (@type), values are read with counter_get() */
+void metrics_print_value(FILE *f, const char *name, const char *type,
+  const char *help, double value);
+
+/* Print cumulative buckets, sum and count of @h */
+void metrics_print_hist(FILE *f, const struct histogram *h);
+
+#endif
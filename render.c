@@ -0,0 +1,177 @@
+/*
+ * Software renderer of square wave PCM.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "render.h"
+
+/* Samples per write, multiple of LANES */
+#define RENDER_BLOCK 4096
+
+/* Samples per vector, GCC lowers vectors to what the CPU has */
+#define LANES 8
+
+typedef uint32_t v_u32 __attribute__((vector_size(4 * LANES)));
+typedef int32_t v_s32 __attribute__((vector_size(4 * LANES)));
+typedef int16_t v_s16 __attribute__((vector_size(2 * LANES)));
+
+struct wav_header {
+	char riff[4];
+	uint32_t riff_size; /* 36 + data_size */
+	char wave[4];
+	char fmt[4];
+	uint32_t fmt_size;
+	uint16_t format;
+	uint16_t channels;
+	uint32_t rate;
+	uint32_t byte_rate;
+	uint16_t block_align;
+	uint16_t bits;
+	char data[4];
+	uint32_t data_size;
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		if ((n = write(fd, p, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Generate @n samples of square wave with phase increment @inc per
+ * sample: +amplitude in the first half of period, -amplitude in the
+ * second one. LANES samples are made at once from their phases.
+ *
+ * Return: phase after the last sample,
+ */
+static uint32_t square_block(int16_t *out, int n, uint32_t phase,
+  uint32_t inc)
+{
+	static const v_u32 lane = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	v_u32 ph = phase + lane * inc;
+	v_s32 m, s;
+	v_s16 v;
+	int i;
+
+	for (i = 0; i + LANES <= n; i += LANES) {
+		/* m = -1 in the second half, s = +-amplitude */
+		m = (v_s32)ph >> 31;
+		s = (RENDER_AMPLITUDE ^ m) - m;
+		v = __builtin_convertvector(s, v_s16);
+		memcpy(out + i, &v, sizeof(v));
+		ph += inc * LANES;
+	}
+	phase += (uint32_t)i * inc;
+	for (; i < n; i++, phase += inc)
+		out[i] = (int32_t)phase < 0 ? -RENDER_AMPLITUDE : RENDER_AMPLITUDE;
+	return phase;
+}
+
+int render_open(struct renderer *r, const char *path, int rate)
+{
+	struct wav_header hdr = {
+		.riff = "RIFF", .riff_size = UINT32_MAX, .wave = "WAVE",
+		.fmt = "fmt ", .fmt_size = 16, .format = 1 /* PCM */,
+		.channels = 1, .rate = rate, .byte_rate = rate * 2,
+		.block_align = 2, .bits = 16,
+		.data = "data", .data_size = UINT32_MAX - 36,
+	};
+	int err;
+
+	memset(r, 0, sizeof(*r));
+	r->rate = rate;
+	if (!strcmp(path, "-"))
+		r->fd = dup(STDOUT_FILENO);
+	else
+		r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (r->fd < 0)
+		return -1;
+
+	if (write_all(r->fd, &hdr, sizeof(hdr))) {
+		err = errno;
+		close(r->fd);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int render_tone(struct renderer *r, int freq, uint64_t n)
+{
+	int16_t buf[RENDER_BLOCK];
+	uint32_t inc;
+	int len;
+
+	/* Higher tones would alias to anything */
+	if (freq > r->rate / 2)
+		freq = r->rate / 2;
+	inc = ((uint64_t)freq << 32) / r->rate;
+
+	while (n) {
+		len = n < RENDER_BLOCK ? n : RENDER_BLOCK;
+		if (freq)
+			r->phase = square_block(buf, len, r->phase, inc);
+		else
+			memset(buf, 0, len * sizeof(buf[0]));
+		if (write_all(r->fd, buf, len * sizeof(buf[0])))
+			return -1;
+		r->n_samples += len;
+		n -= len;
+	}
+	return 0;
+}
+
+int render_events(struct renderer *r, const struct note_event *events,
+  int n_events)
+{
+	uint64_t start = r->n_samples, usec = 0, end;
+	int i;
+
+	for (i = 0; i < n_events; i++) {
+		usec += events[i].duration_usec;
+		end = start + (usec * r->rate + 500000) / 1000000;
+		if (render_tone(r, events[i].freq, end - r->n_samples))
+			return -1;
+	}
+	return 0;
+}
+
+int render_close(struct renderer *r)
+{
+	uint64_t size = r->n_samples * 2;
+	uint32_t sizes[2];
+	int err = 0;
+
+	/* Streams keep maximal sizes */
+	if (size <= UINT32_MAX - 36 && lseek(r->fd, 0, SEEK_CUR) >= 0) {
+		sizes[0] = 36 + size;
+		sizes[1] = size;
+		if (pwrite(r->fd, &sizes[0], sizeof(sizes[0]),
+		  offsetof(struct wav_header, riff_size)) != sizeof(sizes[0])
+		  || pwrite(r->fd, &sizes[1], sizeof(sizes[1]),
+		  offsetof(struct wav_header, data_size)) != sizeof(sizes[1]))
+			err = -1;
+	}
+	if (close(r->fd))
+		err = -1;
+	return err;
+}
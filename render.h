@@ -0,0 +1,58 @@
+/*
+ * Software renderer: compiled melody to square wave PCM in WAV
+ * container (mono, signed 16 bit, little endian hosts only), for
+ * hosts without a beeper. Samples are generated in blocks by vector
+ * code, so melody is rendered much faster than it plays.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdint.h>
+
+#include "rtttl.h"
+
+#define RENDER_RATE 44100
+#define RENDER_AMPLITUDE 8192 /* Of 32767 */
+
+struct renderer {
+	int fd;
+	int rate;
+	uint32_t phase;     /* Phase accumulator, top bit is wave half */
+	uint64_t n_samples; /* Written */
+};
+
+/*
+ * Create WAV file @path ('-' -- stdout) and write its header. If
+ * output isn't seekable, header has maximal sizes, as for streams.
+ *
+ * Return: 0 -- Ok, <0 -- error (see errno),
+ */
+int render_open(struct renderer *r, const char *path, int rate);
+
+/*
+ * Append @n samples of tone @freq (0 -- silence).
+ *
+ * Return: 0 -- Ok, <0 -- error (see errno),
+ */
+int render_tone(struct renderer *r, int freq, uint64_t n);
+
+/*
+ * Append compiled melody. Note boundaries are rounded to samples
+ * from the melody start, so rounding errors don't accumulate.
+ *
+ * Return: 0 -- Ok, <0 -- error (see errno),
+ */
+int render_events(struct renderer *r, const struct note_event *events,
+  int n_events);
+
+/*
+ * Write data size to header, if output is seekable, and close it.
+ *
+ * Return: 0 -- Ok, <0 -- error (see errno),
+ */
+int render_close(struct renderer *r);
+
+#endif
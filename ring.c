@@ -0,0 +1,183 @@
+/*
+ * Shared memory ring of tone records.
+ *
+ * Every slot has a sequence number (as in D. Vyukov's bounded queue):
+ * slot of position pos is free for the producer when seq == pos and
+ * holds a ready record when seq == pos + 1. So producers only race
+ * for the tail and never block each other while writing records.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#define _GNU_SOURCE /* memfd_create() */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "ring.h"
+
+static size_t ring_map_size(uint32_t size)
+{
+	return sizeof(struct ring_hdr) + size * sizeof(struct ring_slot);
+}
+
+int ring_create(struct tone_ring *r)
+{
+	uint32_t i;
+	int err;
+
+	memset(r, 0, sizeof(*r));
+	r->efd = -1;
+	r->map_size = ring_map_size(RING_SIZE);
+	if ((r->memfd = memfd_create("beep-ring", MFD_CLOEXEC)) < 0)
+		return -1;
+	if (ftruncate(r->memfd, r->map_size)
+	  || (r->efd = eventfd(0, EFD_CLOEXEC)) < 0)
+		goto err;
+	r->hdr = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	  r->memfd, 0);
+	if (r->hdr == MAP_FAILED) {
+		r->hdr = NULL;
+		goto err;
+	}
+
+	memcpy(r->hdr->magic, RING_MAGIC, sizeof(r->hdr->magic));
+	r->hdr->size = RING_SIZE;
+	r->mask = RING_SIZE - 1;
+	for (i = 0; i < RING_SIZE; i++)
+		r->hdr->slots[i].seq = i;
+	return 0;
+
+err:
+	err = errno;
+	ring_close(r);
+	errno = err;
+	return -1;
+}
+
+int ring_attach(struct tone_ring *r, int memfd, int efd)
+{
+	struct stat st;
+	uint32_t size;
+	int err;
+
+	memset(r, 0, sizeof(*r));
+	r->memfd = memfd;
+	r->efd = efd;
+	if (fstat(memfd, &st))
+		goto err;
+	if (st.st_size < sizeof(*r->hdr)) {
+		errno = EINVAL;
+		goto err;
+	}
+	r->map_size = st.st_size;
+	r->hdr = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	  memfd, 0);
+	if (r->hdr == MAP_FAILED) {
+		r->hdr = NULL;
+		goto err;
+	}
+	/* Read size once, the header may change under us */
+	size = __atomic_load_n(&r->hdr->size, __ATOMIC_RELAXED);
+	if (memcmp(r->hdr->magic, RING_MAGIC, sizeof(r->hdr->magic))
+	  || !size || size & (size - 1) || ring_map_size(size) != r->map_size) {
+		errno = EINVAL;
+		goto err;
+	}
+	r->mask = size - 1;
+	return 0;
+
+err:
+	err = errno;
+	ring_close(r);
+	errno = err;
+	return -1;
+}
+
+int ring_push(struct tone_ring *r, const struct tone_rec *rec)
+{
+	struct ring_hdr *h = r->hdr;
+	struct ring_slot *slot;
+	uint32_t pos, seq;
+	uint64_t one = 1;
+
+	pos = __atomic_load_n(&h->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &h->slots[pos & r->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&h->tail, &pos, pos + 1,
+			  1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int32_t)(seq - pos) < 0) {
+			errno = EAGAIN;
+			return -1;
+		} else {
+			pos = __atomic_load_n(&h->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->rec = *rec;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* Record must be visible before we look at the consumer */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&h->waiting, 0, __ATOMIC_SEQ_CST))
+		write(r->efd, &one, sizeof(one));
+	return 0;
+}
+
+static inline int ring_ready(struct tone_ring *r)
+{
+	return __atomic_load_n(&r->hdr->slots[r->head & r->mask].seq,
+	  __ATOMIC_ACQUIRE) == r->head + 1;
+}
+
+int ring_pop(struct tone_ring *r, struct tone_rec *rec)
+{
+	struct ring_slot *slot;
+
+	if (!ring_ready(r))
+		return 0;
+	slot = &r->hdr->slots[r->head & r->mask];
+	*rec = slot->rec;
+	/* Free slot for the producer of position head + size */
+	__atomic_store_n(&slot->seq, r->head + r->mask + 1, __ATOMIC_RELEASE);
+	r->head++;
+	return 1;
+}
+
+int ring_wait(struct tone_ring *r)
+{
+	uint64_t n;
+
+	while (!ring_ready(r)) {
+		__atomic_store_n(&r->hdr->waiting, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		/* Record pushed before producer could see us waiting */
+		if (ring_ready(r)) {
+			__atomic_store_n(&r->hdr->waiting, 0, __ATOMIC_RELAXED);
+			break;
+		}
+		if (read(r->efd, &n, sizeof(n)) < 0 && errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+void ring_close(struct tone_ring *r)
+{
+	if (r->hdr)
+		munmap(r->hdr, r->map_size);
+	if (r->memfd >= 0)
+		close(r->memfd);
+	if (r->efd >= 0)
+		close(r->efd);
+	memset(r, 0, sizeof(*r));
+	r->memfd = r->efd = -1;
+}
@@ -0,0 +1,87 @@
+/*
+ * Shared memory ring of tone records. Any number of producers (MPSC,
+ * single producer is just a special case) push records, one consumer
+ * pops them. Ring lives in a memfd, which is passed to producers with
+ * an eventfd. Producers write the eventfd only when the consumer has
+ * found the ring empty and sleeps, i.e. on transition of the ring from
+ * empty to non-empty, so a busy stream of records costs no syscalls.
+ *
+ * Shared memory is writable by every producer, so the consumer keeps
+ * the capacity and its head privately and takes only seq and payload
+ * of slots from the memfd.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_MAGIC "BRNG"
+#define RING_SIZE 1024 /* Records, power of 2 */
+
+struct tone_rec {
+	int32_t freq; /* 0 -- pause */
+	int32_t duration_usec;
+	int32_t priority;
+};
+
+struct ring_slot {
+	uint32_t seq; /* Position of record it holds + 1, if it is ready */
+	struct tone_rec rec;
+};
+
+struct ring_hdr {
+	char magic[4];
+	uint32_t size;
+	uint32_t waiting; /* Consumer sleeps on eventfd */
+	uint32_t tail __attribute__((aligned(64))); /* Next pushed position */
+	struct ring_slot slots[] __attribute__((aligned(64)));
+};
+
+struct tone_ring {
+	struct ring_hdr *hdr;
+	size_t map_size;
+	uint32_t mask; /* Slots - 1, checked on create/attach */
+	uint32_t head; /* Next popped position, consumer only */
+	int memfd;
+	int efd;
+};
+
+/*
+ * Create ring for consumer.
+ *
+ * Return: 0 -- Ok, <0 -- error (see errno),
+ */
+int ring_create(struct tone_ring *r);
+
+/*
+ * Attach producer to ring @memfd, @efd got from consumer. Ring
+ * takes @memfd and @efd.
+ *
+ * Return: 0 -- Ok, <0 -- error (see errno, EINVAL -- not a ring),
+ */
+int ring_attach(struct tone_ring *r, int memfd, int efd);
+
+/* Return: 0 -- Ok, <0 -- ring is full */
+int ring_push(struct tone_ring *r, const struct tone_rec *rec);
+
+/*
+ * Pop record, only one thread may pop.
+ *
+ * Return: 1 -- Ok, 0 -- ring is empty,
+ */
+int ring_pop(struct tone_ring *r, struct tone_rec *rec);
+
+/*
+ * Wait until ring isn't empty.
+ *
+ * Return: 0 -- Ok, <0 -- error,
+ */
+int ring_wait(struct tone_ring *r);
+
+void ring_close(struct tone_ring *r);
+
+#endif
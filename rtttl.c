@@ -0,0 +1,643 @@
+/*
+ * Compiler of melodies written on the Nokia ringtone language
+ * (https://en.wikipedia.org/wiki/Ring_Tone_Text_Transfer_Language)
+ * to arrays of note events. All parser state is kept in
+ * struct parser, so melodies may be compiled concurrently.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+
+#include "rtttl.h"
+#include "trace.h"
+
+#ifdef NO_DEBUG
+#define PDEBUG(p, frmt, ...) do { \
+	if (0) \
+		trace_log(frmt, ##__VA_ARGS__); \
+} while (0)
+#else
+#define PDEBUG(p, frmt, ...) do { \
+	if ((p)->debug) \
+		trace_log(frmt, ##__VA_ARGS__); \
+} while (0)
+#endif
+#define PWARN(p, frmt, ...)  parser_log(p, LOG_WARN, frmt, ##__VA_ARGS__)
+#define PERR(p, frmt, ...)   parser_log(p, LOG_ERR, frmt, ##__VA_ARGS__)
+
+enum log_levels {
+	LOG_WARN=0,
+	LOG_ERR,
+};
+
+/*
+ * Log parser warning or error. If parser has error messages buffer,
+ * then they are appended to it separated with "; ", otherwise they
+ * are logged to stderr. Debug messages go to trace ring.
+ */
+static void parser_log(struct parser *ps, int level, const char *frmt, ...)
+{
+	static const char *l[] = {
+		[LOG_WARN] = "WARNING",
+		[LOG_ERR] = "ERROR",
+	};
+	va_list args;
+	int n;
+
+	va_start(args, frmt);
+	if (!ps->err) {
+		/* Keep order with debug messages logged before */
+		if (ps->debug)
+			trace_flush();
+		/* Don't mix lines logged by different threads */
+		flockfile(stderr);
+		fprintf(stderr, "%s: ", l[level]);
+		vfprintf(stderr, frmt, args);
+		fprintf(stderr, "\n");
+		funlockfile(stderr);
+	} else {
+		n = strlen(ps->err);
+		if (n && n < ps->err_size - 2) {
+			strcpy(ps->err + n, "; ");
+			n += 2;
+		}
+		if (n < ps->err_size - 1)
+			vsnprintf(ps->err + n, ps->err_size - n, frmt, args);
+	}
+	va_end(args);
+}
+
+void parser_init(struct parser *ps, int debug, char *err, int err_size)
+{
+	memset(ps, 0, sizeof(*ps));
+	ps->debug = debug;
+	ps->err = err;
+	ps->err_size = err_size;
+	ps->tuning = default_tuning;
+	ps->gap_pct = ARTICULATION_NORMAL;
+	if (err)
+		*err = '\0';
+}
+
+/* Number of note durations: 1, 2, 4, 8, 16, 32, i.e. 1 << index */
+#define N_DURATIONS 6
+
+/* 2^(i/12), parts per million */
+static const int semitone_ppm[12] = {
+	1000000, 1059463, 1122462, 1189207, 1259921, 1334840,
+	1414214, 1498307, 1587401, 1681793, 1781797, 1887749,
+};
+
+static struct tuning tuning_440;
+const struct tuning *const default_tuning = &tuning_440;
+
+int tuning_init(struct tuning *t, int a4_mhz)
+{
+	int o, i, d, oct, st;
+	long long f;
+
+	if (a4_mhz < TUNING_MIN_A4 || a4_mhz > TUNING_MAX_A4)
+		return -1;
+
+	t->a4_mhz = a4_mhz;
+	for (o = 0; o < TUNING_OCTAVES; o++) {
+		for (i = 0; i < 12; i++) {
+			/* Semitones from A4, floor divided to octaves */
+			d = o * 12 + i - (4 * 12 + 9);
+			oct = d >= 0 ? d / 12 : -((11 - d) / 12);
+			st = d - oct * 12;
+			/* mHz * ppm, rounded to Hz only once */
+			f = (long long)a4_mhz * semitone_ppm[st];
+			f = oct >= 0 ? f << oct : f >> -oct;
+			t->freq[o][i] = (f + 500000000) / 1000000000;
+		}
+		t->freq[o][12] = 0;
+	}
+	return 0;
+}
+
+static void __attribute__((constructor)) default_tuning_init(void)
+{
+	tuning_init(&tuning_440, TUNING_DEFAULT_A4);
+}
+
+/*
+ * Character classes for note decoder, -1 -- char is not of
+ * this class.
+ */
+
+/* Duration index by the first duration digit ("16" and "32" are two-char) */
+static const signed char dur_class[256] = {
+	[0 ... 255] = -1,
+	['1'] = 0, ['2'] = 1, ['3'] = 5, ['4'] = 2, ['8'] = 3,
+};
+
+/* Note column in tone array: [sharp][note char] */
+static const signed char note_class[2][256] = {
+	{
+		[0 ... 255] = -1,
+		['C'] = 0, ['D'] = 2, ['E'] = 4, ['F'] = 5, ['G'] = 7,
+		['A'] = 9, ['B'] = 11, ['P'] = 12,
+		['c'] = 0, ['d'] = 2, ['e'] = 4, ['f'] = 5, ['g'] = 7,
+		['a'] = 9, ['b'] = 11, ['p'] = 12,
+	}, { /* There are no E# and B#, they are E and B */
+		[0 ... 255] = -1,
+		['C'] = 1, ['D'] = 3, ['E'] = 4, ['F'] = 6, ['G'] = 8,
+		['A'] = 10, ['B'] = 11, ['P'] = 12,
+		['c'] = 1, ['d'] = 3, ['e'] = 4, ['f'] = 6, ['g'] = 8,
+		['a'] = 10, ['b'] = 11, ['p'] = 12,
+	},
+};
+
+/* Octave row in tuning table */
+static const signed char octave_class[256] = {
+	[0 ... 255] = -1,
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+	['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+};
+
+/* Trace decoded note, out of line, so it costs nothing w/o debug */
+static void __attribute__((noinline, cold)) trace_note(struct parser *ps,
+  int ni, int c, int sharp, int o, int d, int dot, int freq,
+  int duration_usec)
+{
+	PDEBUG(ps, "Note #%d: note = %c%c, octave = %d, duration = %d%c, freq,HZ = %d,"
+		" duration,msecs = %d", ni, toupper(c), sharp ? '#' : ' ', o,
+		1 << d, dot ? '.' : ' ', freq, duration_usec/1000);
+}
+
+int parse_note(struct parser *ps, int ni, const char *s, int len, int *freq,
+  int *duration_usec)
+{
+	const unsigned char *p = (const unsigned char *)s, *end = p + len;
+	int c, col, sharp, dot, d, o;
+
+	if (p == end)
+		goto bad_note;
+
+	/* Get duration */
+	d = dur_class[*p];
+	if (d < 0) {
+		d = ps->duration_idx;
+	} else if (++p < end && *p == '6' && d == 0) {
+		d = 4; /* 16 */
+		p++;
+	} else if (d == 5 && (p == end || *p++ != '2')) {
+		PWARN(ps, "Note #%d: expected duration 32", ni);
+		return -1;
+	}
+
+	/* Get note */
+	if (p == end || note_class[0][c = *p++] < 0)
+		goto bad_note;
+	sharp = p < end && *p == '#';
+	p += sharp;
+	dot = p < end && *p == '.';
+	p += dot;
+	col = note_class[sharp][c];
+
+	/* Get octave */
+	if (p == end) {
+		o = ps->octave;
+	} else if ((o = octave_class[*p++]) < 0) {
+		PWARN(ps, "Note #%d: expected octave (0-9)", ni);
+		return -1;
+	}
+	/* Dot may follow octave too, as in RTTTL spec: "c6." */
+	if (!dot && p < end && *p == '.') {
+		dot = 1;
+		p++;
+	}
+	if (p != end) {
+		PWARN(ps, "Note #%d: unexpected '%c' after note", ni, *p);
+		return -1;
+	}
+
+	*freq = ps->tuning->freq[o][col];
+	*duration_usec = ps->duration_usec[dot][d];
+
+	if (ps->debug)
+		trace_note(ps, ni, c, sharp, o, d, dot, *freq, *duration_usec);
+
+	return 0;
+
+bad_note:
+	PWARN(ps, "Note #%d: expected note (CDEFGAB)", ni);
+	return -1;
+}
+
+static inline const char *skip_ws_span(const char *s, const char *end)
+{
+	while (s < end && isspace(*s))
+		s++;
+	return s;
+}
+
+/*
+ * Parse numeric parameter setting in format: "letter=num".
+ * After num expects ',' or @end. Used for parsing melody
+ * defaults section (e.g. "o=5,b=120,d=4").
+ *
+ * Return: pointer to the next char or NULL (in case of error
+ *   or empty string).
+ * Out: @c -- parameter letter, @n -- parameter numeric
+ *   value (max 999), @err -- error status.
+ */
+static const char *char_eq_num(const char *s, const char *end, int *c,
+  int *n, int *err)
+{
+	*err = 0;
+	s = skip_ws_span(s, end);
+	if (s == end)
+		return NULL;
+	*err = -1;
+	*c = *s++;
+	s = skip_ws_span(s, end);
+	if (s == end || *s != '=')
+		return NULL;
+	s = skip_ws_span(s + 1, end);
+	if (s == end || !isdigit(*s))
+		return NULL;
+	*n = *s++ - '0';
+	while (s < end && isdigit(*s) && *n < 999) {
+		*n =  *n * 10 + (*s - '0');
+		s++;
+	}
+	if (s < end) {
+		if (*s++ != ',')
+			return NULL;
+	}
+	*err = 0;
+	return s;
+}
+
+/*
+ * Parse string of numeric parameters separated with comma.
+ * Used for parsing melody defaults section, e.g. "d=4,o=5,b=120".
+ *
+ * In: @s, @len -- defaults section,
+ * Out: @num[26]: <0 -- missing, >=0 -- parameter value.
+ * Return: 0 -- Ok, <0 -- error.
+ */
+static int parse_char_eq_num_str(struct parser *ps, const char *s, int len,
+  int num[26])
+{
+	const char *end = s + len;
+	int i, c, n, err;
+
+	for (i = 0; i < 26; i++)
+		num[i] = -1;
+	while (s = char_eq_num(s, end, &c, &n, &err)) {
+		if (c < 'a' || c > 'z') {
+			PWARN(ps, "Unknown default param '%c'", c);
+		} else if (num[c - 'a'] < 0) {
+			num[c - 'a'] = n;
+		} else {
+			PWARN(ps, "Default param '%c' has been already set", c);
+		}
+	}
+	return err;
+}
+
+#define DEFAULTS(c) (defaults[(c) - 'a'])
+
+/*
+ * Set defaults from melody defaults section.
+ *
+ * Return: 0 -- Ok, <0 -- error (invalid or missing defaults).
+ */
+static int set_defaults(struct parser *ps, const int defaults[26])
+{
+	int n, i, d;
+
+	n = DEFAULTS('o');
+	if (n < 0) {
+		PERR(ps, "Missing required default octave");
+		return -1;
+	}
+	if (n >= TUNING_OCTAVES) {
+		PERR(ps, "Invalid default octave, must be 0-%d", TUNING_OCTAVES - 1);
+		return -1;
+	}
+	ps->octave = n;
+
+	n = DEFAULTS('d');
+	if (n < 0) {
+		PERR(ps, "Missing required default duration");
+		return -1;
+	}
+	for (i = 0; i < N_DURATIONS && n != 1 << i; i++)
+		;
+	if (i == N_DURATIONS) {
+		PERR(ps, "Invalid default duration, must be 1,2,4,8,16,32");
+		return -1;
+	}
+	ps->duration = n;
+	ps->duration_idx = i;
+
+	n = DEFAULTS('b');
+	if (n < 0) {
+		PERR(ps, "Missing required default beats");
+		return -1;
+	}
+	if (n < 40 || n > 200) {
+		PERR(ps, "Invalid default beats, must be 40-200");
+		return -1;
+	}
+	ps->tempo = n;
+
+	PDEBUG(ps, "Defaults: octave=%d, duration=%d, beats/tempo=%d", ps->octave,
+	  ps->duration, ps->tempo);
+
+	/* Durations of all notes, rounded to usec */
+	for (i = 0; i < N_DURATIONS; i++) {
+		d = ps->tempo << i;
+		ps->duration_usec[0][i] = (60000000 * 4 + d / 2) / d;
+		ps->duration_usec[1][i] = (60000000 * 6 + d / 2) / d;
+	}
+	PDEBUG(ps, "Note duration,usecs: %d", ps->duration_usec[0][0]);
+
+	return 0;
+}
+
+void stream_init(struct melody_stream *st, struct parser *ps)
+{
+	st->ps = ps;
+	if (ps->err)
+		*ps->err = '\0';
+	st->state = ST_NAME;
+	st->ni = 1;
+	st->len = 0;
+}
+
+/*
+ * Compile token: defaults section or note. Token is parsed in place,
+ * it may point to the melody itself or to buffered token.
+ *
+ * Out: @ev -- compiled note and its pause, if any,
+ * Return: number of events (0-2), <0 -- error,
+ */
+static int stream_token(struct melody_stream *st, const char *s, int len,
+  struct note_event *ev)
+{
+	int defaults[26];
+	int ni, gap;
+
+	st->len = 0;
+	while (len && isspace(*s)) {
+		s++;
+		len--;
+	}
+	while (len && isspace(s[len - 1]))
+		len--;
+
+	if (st->state == ST_DEFAULTS) {
+		PDEBUG(st->ps, "Defaults section: %.*s", len, s);
+		if (parse_char_eq_num_str(st->ps, s, len, defaults)) {
+			PERR(st->ps, "Failed to parse defaults section");
+			return -1;
+		}
+		if (set_defaults(st->ps, defaults))
+			return -1;
+		st->state = ST_NOTES;
+		return 0;
+	}
+
+	ni = st->ni++;
+	if (!len) /* Empty note, e.g. trailing comma */
+		return 0;
+	PDEBUG(st->ps, "Note #%d: %.*s", ni, len, s);
+	if (parse_note(st->ps, ni, s, len, &ev->freq, &ev->duration_usec)) {
+		PERR(st->ps, "Failed to parse note #%d", ni);
+		return -1;
+	}
+	st->ps->n_notes++;
+
+	if (!ev->freq || !(gap = (ev->duration_usec * (long long)st->ps->gap_pct
+	  + 50) / 100))
+		return 1;
+	ev->duration_usec -= gap;
+	ev[1].freq = 0;
+	ev[1].duration_usec = gap;
+	return 2;
+}
+
+/* Buffer part of token, which continues in the next chunk */
+static int stream_append(struct melody_stream *st, const char *s, int len)
+{
+	if (!st->len) {
+		while (len && isspace(*s)) {
+			s++;
+			len--;
+		}
+	}
+	if (st->len + len > sizeof(st->tok)) {
+		if (st->state == ST_DEFAULTS)
+			PERR(st->ps, "Too long defaults section");
+		else
+			PERR(st->ps, "Too long note #%d", st->ni);
+		return -1;
+	}
+	memcpy(st->tok + st->len, s, len);
+	st->len += len;
+	return 0;
+}
+
+int stream_end(struct melody_stream *st, struct note_event *ev)
+{
+	int n;
+
+	switch (st->state) {
+	case ST_NAME:
+		PERR(st->ps, "Missing required defaults section in melody");
+		return -1;
+	case ST_DEFAULTS:
+		PERR(st->ps, "Missing required notes section in melody");
+		return -1;
+	case ST_NOTES:
+		n = stream_token(st, st->tok, st->len, ev);
+		st->state = ST_END;
+		return n;
+	}
+	return 0;
+}
+
+int stream_feed(struct melody_stream *st, const char *s, int len,
+  struct note_event *ev)
+{
+	const char *end = s + len, *q;
+	int sep, r, n = 0;
+
+	while (s < end && st->state != ST_END) {
+		sep = st->state == ST_NOTES ? ',' : ':';
+		for (q = s; q < end && *q != sep && *q != '\n'; q++)
+			;
+
+		if (q == end) {
+			/* Token continues in the next chunk */
+			if (st->state != ST_NAME && stream_append(st, s, q - s))
+				return -1;
+			break;
+		}
+
+		if (*q == '\n' && st->state != ST_NOTES)
+			return stream_end(st, ev + n);
+
+		if (st->state == ST_NAME) {
+			st->state = ST_DEFAULTS;
+		} else {
+			if (!st->len) {
+				r = stream_token(st, s, q - s, ev + n);
+			} else if (!(r = stream_append(st, s, q - s))) {
+				r = stream_token(st, st->tok, st->len, ev + n);
+			}
+			if (r < 0)
+				return r;
+			n += r;
+		}
+
+		if (*q == '\n')
+			st->state = ST_END;
+		s = q + 1;
+	}
+
+	return n;
+}
+
+int compile_span(struct parser *ps, const char *melody, int len,
+  struct note_event **events, int *n_events)
+{
+	struct melody_stream st;
+	struct note_event *ev;
+	const char *q, *end = melody + len;
+	int n, r;
+
+	/* Number of notes is at most number of commas + 1, each with pause */
+	for (n = 1, q = melody; q = memchr(q, ',', end - q); q++)
+		n++;
+	ev = malloc(2 * n * sizeof(*ev));
+	if (!ev) {
+		PERR(ps, "Failed to allocate %d note events", 2 * n);
+		return -1;
+	}
+
+	stream_init(&st, ps);
+	if ((n = stream_feed(&st, melody, len, ev)) < 0
+	  || (r = stream_end(&st, ev + n)) < 0) {
+		free(ev);
+		return -1;
+	}
+
+	*events = ev;
+	*n_events = n + r;
+	return 0;
+}
+
+int compile(struct parser *ps, const char *melody,
+  struct note_event **events, int *n_events)
+{
+	return compile_span(ps, melody, strlen(melody), events, n_events);
+}
+
+/* Get melody name (text before the first ':' w/o spaces) */
+void melody_name(const char *melody, int len, char name[MELODY_MAX_NAME])
+{
+	const char *p, *q, *end = melody + len;
+
+	p = skip_ws_span(melody, end);
+	q = memchr(p, ':', end - p);
+	if (!q)
+		q = p;
+	while (q > p && isspace(q[-1]))
+		q--;
+	if (q - p >= MELODY_MAX_NAME)
+		q = p; /* Too long name is not indexed */
+	memcpy(name, p, q - p);
+	name[q - p] = '\0';
+}
+
+int transform_check(const struct transform *xf)
+{
+	return xf->semitones < -TRANSFORM_MAX_SEMITONES
+	  || xf->semitones > TRANSFORM_MAX_SEMITONES
+	  || xf->tempo_pct && (xf->tempo_pct < TRANSFORM_MIN_TEMPO
+	  || xf->tempo_pct > TRANSFORM_MAX_TEMPO)
+	  || xf->loops < TRANSFORM_LOOP_FOREVER ? -1 : 0;
+}
+
+/* Return: note of @t (octave * 12 + note) tuned to @freq, <0 -- none */
+static int tuning_note(const struct tuning *t, int freq)
+{
+	int lo = 0, hi = TUNING_OCTAVES * 12 - 1, m, f;
+
+	/* Rows are concatenated in ascending order, w/o pause column */
+	while (lo <= hi) {
+		m = (lo + hi) / 2;
+		f = t->freq[m / 12][m % 12];
+		if (f == freq)
+			return m;
+		if (f < freq)
+			lo = m + 1;
+		else
+			hi = m - 1;
+	}
+	return -1;
+}
+
+void transform_note(const struct transform *xf, const struct tuning *t,
+  struct note_event *e)
+{
+	int oct, st, k;
+	long long f;
+
+	if (e->freq && xf->semitones
+	  && (k = tuning_note(t, e->freq)) >= 0) {
+		/* Keep the note, but not the octave, if out of table */
+		k += xf->semitones;
+		while (k >= TUNING_OCTAVES * 12)
+			k -= 12;
+		while (k < 0 || t->freq[k / 12][k % 12] < TONE_MIN_HZ)
+			k += 12;
+		e->freq = t->freq[k / 12][k % 12];
+	} else if (e->freq && xf->semitones) {
+		/* Not a note of @t: scale, rounding error is only one */
+		oct = xf->semitones >= 0 ? xf->semitones / 12
+		  : -((11 - xf->semitones) / 12);
+		st = xf->semitones - oct * 12;
+		f = (long long)e->freq * semitone_ppm[st];
+		f = oct >= 0 ? f << oct : f >> -oct;
+		while (f > TONE_MAX_HZ * 1000000LL)
+			f >>= 1;
+		while (f < TONE_MIN_HZ * 1000000LL)
+			f <<= 1;
+		e->freq = (f + 500000) / 1000000;
+	}
+	if (xf->tempo_pct && xf->tempo_pct != 100)
+		e->duration_usec = ((long long)e->duration_usec * 100
+		  + xf->tempo_pct / 2) / xf->tempo_pct;
+}
+
+int transform_events(const struct transform *xf, const struct tuning *t,
+  const struct note_event *events, int n_events, struct note_event **out)
+{
+	struct note_event *ev;
+	int i;
+
+	if (transform_check(xf))
+		return -1;
+	if (!(ev = malloc(n_events * sizeof(*ev) + 1)))
+		return -1;
+
+	for (i = 0; i < n_events; i++) {
+		ev[i] = events[i];
+		transform_note(xf, t, &ev[i]);
+	}
+
+	*out = ev;
+	return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * Compiler of melodies written on the Nokia ringtone language
+ * (https://en.wikipedia.org/wiki/Ring_Tone_Text_Transfer_Language)
+ * to arrays of note events.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#ifndef RTTTL_H
+#define RTTTL_H
+
+#include <ctype.h>
+
+#define MELODY_MAX_NAME 64
+
+/*
+ * Tuning: frequencies of all notes of octaves 0-9 in equal
+ * temperament, generated from A4 reference by fixed point math.
+ */
+#define TUNING_OCTAVES 10
+#define TUNING_DEFAULT_A4 440000 /* mHz */
+#define TUNING_MIN_A4 400000
+#define TUNING_MAX_A4 480000
+
+struct tuning {
+	int a4_mhz;
+	/* [octave][note], last column is for pause, rounded to Hz */
+	int freq[TUNING_OCTAVES][13];
+};
+
+/* Default tuning, A4 = 440 Hz */
+extern const struct tuning *const default_tuning;
+
+/*
+ * Generate tuning table for @a4_mhz reference (mHz).
+ *
+ * Return: 0 -- Ok, <0 -- reference out of range,
+ */
+int tuning_init(struct tuning *t, int a4_mhz);
+
+/*
+ * Articulation: pause after every note in percent of its duration.
+ * Pause is carved out of the note, so melody lasts as its tempo says.
+ */
+#define ARTICULATION_LEGATO 0
+#define ARTICULATION_NORMAL 20
+#define ARTICULATION_STACCATO 50
+#define ARTICULATION_MAX 90
+
+/* Compiled note: a note with pause after it compiles to two events */
+struct note_event {
+	int freq; /* 0 -- pause */
+	int duration_usec;
+};
+
+/*
+ * Parser context. Parse functions keep all their state here, so
+ * different melodies may be parsed concurrently in threads, each
+ * with its own context.
+ */
+struct parser {
+	/* Default values */
+	int octave;   /* Possible values: 0-9 */
+	int duration; /* Possible values: 1, 2, 4, 8, 16, 32 */
+	int tempo;    /* Possible values: 40-200 */
+
+	/*
+	 * Durations of notes for this tempo: [dot][index], where
+	 * index is log2 of note duration, e.g. 3 for 1/8
+	 */
+	int duration_idx;
+	int duration_usec[2][6];
+
+	const struct tuning *tuning; /* Note frequencies, default_tuning */
+	int gap_pct; /* Articulation, see ARTICULATION_* */
+
+	int debug; /* Log parsed values to trace ring */
+
+	int n_notes; /* Compiled notes (w/o articulation pauses) */
+
+	/* Buffer for error messages, NULL -- log them to stderr */
+	char *err;
+	int err_size;
+};
+
+/*
+ * Streaming melody compiler. Melody is fed by chunks of any size.
+ * Tokens are parsed in place, only a token which spans chunk
+ * boundary is buffered, so memory use doesn't depend on melody
+ * length.
+ */
+enum stream_states {
+	ST_NAME=0,
+	ST_DEFAULTS,
+	ST_NOTES,
+	ST_END,
+};
+
+struct melody_stream {
+	struct parser *ps;
+	int state;
+	int ni;       /* Index of current note */
+	int len;      /* Length of buffered token */
+	char tok[32]; /* Token which spans chunks: defaults section or note */
+};
+
+/*
+ * @err, @err_size -- buffer for error messages (may be NULL). Notes
+ * are tuned by default_tuning with ARTICULATION_NORMAL, set
+ * ps->tuning and ps->gap_pct after init to change them.
+ */
+void parser_init(struct parser *ps, int debug, char *err, int err_size);
+
+void stream_init(struct melody_stream *st, struct parser *ps);
+
+/*
+ * Compile next chunk of melody. Melody ends with '\n' or
+ * with stream_end() call, the rest of chunk after '\n' is ignored.
+ *
+ * In: @s, @len -- chunk,
+ * Out: @ev -- compiled events, must have room for
+ *   2 * (number of ',' in chunk + 1) events,
+ * Return: number of compiled events, <0 -- error,
+ */
+int stream_feed(struct melody_stream *st, const char *s, int len,
+  struct note_event *ev);
+
+/*
+ * Finish melody, i.e. compile the last note.
+ *
+ * Out: @ev -- room for two events,
+ * Return: number of compiled events, <0 -- error,
+ */
+int stream_end(struct melody_stream *st, struct note_event *ev);
+
+/*
+ * Compile melody to array of note events. Nothing is played,
+ * so an invalid melody is rejected before the first note.
+ * Safe to call concurrently with different parser contexts.
+ *
+ * Out: @events -- array of note events (caller must free it),
+ *   @n_events -- number of events in array,
+ * Return: 0 -- Ok, <0 -- error,
+ */
+int compile(struct parser *ps, const char *melody,
+  struct note_event **events, int *n_events);
+
+/* Same as compile(), but melody is @len bytes at @melody, no '\0' needed */
+int compile_span(struct parser *ps, const char *melody, int len,
+  struct note_event **events, int *n_events);
+
+/*
+ * Compile single note. Parser defaults must be already set.
+ *
+ * In: @ni -- note index (for error messages), @s, @len -- note
+ *   string in format: "[<duration>][CDEFGABP][#][.][<octave>][.]",
+ *   one dot at most,
+ * Out: @freq, @duration_usec -- nominal, articulation isn't applied,
+ * Return: 0 -- Ok, <0 -- error,
+ */
+int parse_note(struct parser *ps, int ni, const char *s, int len, int *freq,
+  int *duration_usec);
+
+/*
+ * Transformation of compiled melody, zero fields -- no change.
+ */
+#define TRANSFORM_MAX_SEMITONES 48
+#define TRANSFORM_MIN_TEMPO 10
+#define TRANSFORM_MAX_TEMPO 1000
+#define TRANSFORM_LOOP_FOREVER (-1)
+
+/* Transposed notes are shifted by octaves to stay in this range */
+#define TONE_MIN_HZ 16
+#define TONE_MAX_HZ 20000
+
+struct transform {
+	int semitones; /* Transpose up (>0) or down (<0) */
+	int tempo_pct; /* Tempo, percent of original: 200 -- twice faster */
+	int loops;     /* Play melody this number of times (0 -- once),
+	                  TRANSFORM_LOOP_FOREVER -- until stopped. Done by
+	                  players, events aren't copied */
+};
+
+/* Return: 0 -- Ok, <0 -- value out of range */
+int transform_check(const struct transform *xf);
+
+/*
+ * Transpose and scale tempo of note @e in place. Notes of tuning @t,
+ * which melody is compiled with, are transposed by the table, other
+ * tones by frequency ratio.
+ */
+void transform_note(const struct transform *xf, const struct tuning *t,
+  struct note_event *e);
+
+/*
+ * Transpose and scale tempo of compiled melody, no parsing is done.
+ * @xf->loops is left to the player.
+ *
+ * Out: @out -- @n_events transformed events (caller must free it),
+ * Return: 0 -- Ok, <0 -- error (invalid transformation or no memory),
+ */
+int transform_events(const struct transform *xf, const struct tuning *t,
+  const struct note_event *events, int n_events, struct note_event **out);
+
+/* Get melody name (text before the first ':' w/o spaces) */
+void melody_name(const char *melody, int len, char name[MELODY_MAX_NAME]);
+
+static inline const char *skip_ws(const char *s)
+{
+	while (isspace(*s))
+		s++;
+	return s;
+}
+
+#endif
@@ -0,0 +1,425 @@
+/*
+ * Debug trace ring.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "trace.h"
+
+enum arg_types {
+	ARG_NONE=0, /* Unsupported conversion */
+	ARG_INT,
+	ARG_LONG,
+	ARG_LLONG,
+	ARG_DOUBLE,
+	ARG_PTR,
+	ARG_STR,
+};
+
+union trace_arg {
+	long long i; /* Also '*' and offset of string in @str */
+	double d;
+	const void *p;
+};
+
+struct trace_rec {
+	uint64_t nsec; /* CLOCK_MONOTONIC */
+	const char *frmt;
+	int n_args;
+	int str_len;
+	union trace_arg arg[TRACE_ARGS];
+	char str[TRACE_STR];
+};
+
+/*
+ * As tone ring slot, but seq is kept less lap base of positions
+ * (position & ~(TRACE_RECORDS - 1)), so zeroed slots are free and
+ * the ring doesn't need initialization.
+ */
+struct trace_slot {
+	uint32_t seq; /* Lap base of record it holds + 1, if it is ready */
+	struct trace_rec rec;
+};
+
+/* Conversion specification of format */
+struct conv {
+	const char *start; /* '%' */
+	int stars;         /* Arguments for width and precision */
+	int prec_star;     /* Precision is the last of them */
+	int prec;          /* -1 -- none or '*' */
+	int type;
+};
+
+#define LAP(pos) ((pos) & ~(TRACE_RECORDS - 1))
+
+static struct {
+	uint32_t tail __attribute__((aligned(64))); /* Next pushed position */
+	uint32_t head __attribute__((aligned(64))); /* Next popped position */
+	uint32_t sleeping; /* Flusher waits on efd */
+	unsigned long dropped;
+	int efd; /* Flusher thread wakeup, -1 -- there is no flusher */
+	pthread_mutex_t lock; /* Of popping */
+} trace = {
+	.efd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Apart from the above, so it is in .bss */
+static struct trace_slot slots[TRACE_RECORDS] __attribute__((aligned(64)));
+
+/*
+ * Find next conversion specification in @p and parse it.
+ *
+ * Return: pointer after it, NULL -- there is no more,
+ */
+static const char *next_conv(const char *p, struct conv *c)
+{
+	static const char *digits = "0123456789";
+	int len = 0;
+
+	for (; *p; p++) {
+		if (*p != '%')
+			continue;
+		if (p[1] == '%') {
+			p++;
+			continue;
+		}
+
+		c->start = p++;
+		c->stars = c->prec_star = 0;
+		c->prec = -1;
+		p += strspn(p, "-+ #0");
+		if (*p == '*') {
+			c->stars++;
+			p++;
+		} else {
+			p += strspn(p, digits);
+		}
+		if (*p == '.') {
+			p++;
+			if (*p == '*') {
+				c->stars++;
+				c->prec_star = 1;
+				p++;
+			} else {
+				c->prec = atoi(p);
+				p += strspn(p, digits);
+			}
+		}
+
+		while (*p == 'h')
+			p++;
+		if (*p == 'l') {
+			len = *++p == 'l' ? 2 : 1;
+			p += len - 1;
+		} else if (*p == 'j') {
+			len = 2;
+			p++;
+		} else if (*p == 'z' || *p == 't') {
+			len = 1;
+			p++;
+		}
+
+		switch (*p) {
+		case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+		case 'c':
+			c->type = len == 2 ? ARG_LLONG : len ? ARG_LONG : ARG_INT;
+			break;
+		case 'e': case 'f': case 'g': case 'a':
+		case 'E': case 'F': case 'G': case 'A':
+			c->type = ARG_DOUBLE;
+			break;
+		case 'p':
+			c->type = ARG_PTR;
+			break;
+		case 's':
+			c->type = ARG_STR;
+			break;
+		default:
+			c->type = ARG_NONE;
+			return p;
+		}
+		return p + 1;
+	}
+	return NULL;
+}
+
+/* Copy string @s of at most @max (-1 -- any) bytes to record */
+static long long rec_str(struct trace_rec *r, const char *s, int max)
+{
+	int room = TRACE_STR - 1 - r->str_len, len;
+	long long off = r->str_len;
+
+	if (room <= 0)
+		return TRACE_STR - 1;
+	if (max < 0 || max > room)
+		max = room;
+	len = strnlen(s ? s : "(null)", max);
+	memcpy(r->str + off, s ? s : "(null)", len);
+	r->str[off + len] = '\0';
+	r->str_len += len + 1;
+	return off;
+}
+
+static void rec_args(struct trace_rec *r, const char *frmt, va_list args)
+{
+	struct conv c;
+	int i, n = 0;
+
+	r->str_len = 0;
+	r->str[TRACE_STR - 1] = '\0';
+	while ((frmt = next_conv(frmt, &c)) && c.type != ARG_NONE
+	  && n + c.stars < TRACE_ARGS) {
+		for (i = 0; i < c.stars; i++)
+			r->arg[n++].i = va_arg(args, int);
+
+		switch (c.type) {
+		case ARG_INT:
+			r->arg[n].i = va_arg(args, int);
+			break;
+		case ARG_LONG:
+			r->arg[n].i = va_arg(args, long);
+			break;
+		case ARG_LLONG:
+			r->arg[n].i = va_arg(args, long long);
+			break;
+		case ARG_DOUBLE:
+			r->arg[n].d = va_arg(args, double);
+			break;
+		case ARG_PTR:
+			r->arg[n].p = va_arg(args, void *);
+			break;
+		case ARG_STR:
+			r->arg[n].i = rec_str(r, va_arg(args, const char *),
+			  c.prec_star ? (int)r->arg[n - 1].i : c.prec);
+			break;
+		}
+		n++;
+	}
+	r->n_args = n;
+}
+
+void trace_log(const char *frmt, ...)
+{
+	struct trace_slot *slot;
+	struct timespec t;
+	uint32_t pos, seq;
+	uint64_t one = 1;
+	va_list args;
+
+	pos = __atomic_load_n(&trace.tail, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &slots[pos & (TRACE_RECORDS - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == LAP(pos)) {
+			if (__atomic_compare_exchange_n(&trace.tail, &pos,
+			  pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((int32_t)(seq - LAP(pos)) < 0) {
+			__atomic_fetch_add(&trace.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&trace.tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	slot->rec.nsec = t.tv_sec * 1000000000ULL + t.tv_nsec;
+	slot->rec.frmt = frmt;
+	va_start(args, frmt);
+	rec_args(&slot->rec, frmt, args);
+	va_end(args);
+	__atomic_store_n(&slot->seq, LAP(pos) + 1, __ATOMIC_RELEASE);
+
+	/*
+	 * Don't let a burst of records fill the ring: wake flusher, if
+	 * it sleeps, so that's at most one syscall per half of ring
+	 */
+	if (pos + 1 - __atomic_load_n(&trace.head, __ATOMIC_RELAXED)
+	  < TRACE_RECORDS / 2)
+		return;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&trace.sleeping, 0, __ATOMIC_SEQ_CST))
+		write(trace.efd, &one, sizeof(one));
+}
+
+/* Print format text from @p to @end, "%%" is '%' */
+static void put_text(FILE *f, const char *p, const char *end)
+{
+	for (; p < end; p++) {
+		if (*p == '%' && p + 1 < end && p[1] == '%')
+			p++;
+		fputc(*p, f);
+	}
+}
+
+static void print_rec(FILE *f, const struct trace_rec *r)
+{
+	const char *p = r->frmt, *q;
+	char spec[32];
+	struct conv c;
+	int len, n = 0;
+
+	fprintf(f, "DEBUG: [%llu.%06llu] ",
+	  (unsigned long long)(r->nsec / 1000000000),
+	  (unsigned long long)(r->nsec % 1000000000 / 1000));
+	while ((q = next_conv(p, &c))) {
+		if (c.type == ARG_NONE || n + c.stars >= r->n_args) {
+			/* Arguments weren't stored */
+			put_text(f, p, c.start);
+			fputs("...", f);
+			fputc('\n', f);
+			return;
+		}
+		put_text(f, p, c.start);
+
+		/* Specification with stars replaced by their values */
+		for (len = 0; c.start < q && len < sizeof(spec) - 12;
+		  c.start++) {
+			if (*c.start == '*')
+				len += sprintf(spec + len, "%d",
+				  (int)r->arg[n++].i);
+			else
+				spec[len++] = *c.start;
+		}
+		spec[len] = '\0';
+
+		switch (c.type) {
+		case ARG_INT:
+			fprintf(f, spec, (int)r->arg[n].i);
+			break;
+		case ARG_LONG:
+			fprintf(f, spec, (long)r->arg[n].i);
+			break;
+		case ARG_LLONG:
+			fprintf(f, spec, r->arg[n].i);
+			break;
+		case ARG_DOUBLE:
+			fprintf(f, spec, r->arg[n].d);
+			break;
+		case ARG_PTR:
+			fprintf(f, spec, r->arg[n].p);
+			break;
+		case ARG_STR:
+			fprintf(f, spec, r->str + r->arg[n].i);
+			break;
+		}
+		n++;
+		p = q;
+	}
+	put_text(f, p, p + strlen(p));
+	fputc('\n', f);
+}
+
+void trace_flush(void)
+{
+	struct trace_slot *slot;
+	unsigned long dropped;
+	uint32_t pos;
+	char *buf = NULL;
+	size_t size;
+	FILE *f;
+	int n;
+
+	pthread_mutex_lock(&trace.lock);
+	/* Format all at once, stderr is unbuffered */
+	if (!(f = open_memstream(&buf, &size)))
+		f = stderr;
+	pos = trace.head;
+	for (n = 0; n < TRACE_RECORDS; n++, pos++) {
+		slot = &slots[pos & (TRACE_RECORDS - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)
+		  != LAP(pos) + 1)
+			break;
+		print_rec(f, &slot->rec);
+		/* Free slot for the producer of position pos + size */
+		__atomic_store_n(&slot->seq, LAP(pos) + TRACE_RECORDS,
+		  __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&trace.head, pos, __ATOMIC_RELAXED);
+	if ((dropped = __atomic_exchange_n(&trace.dropped, 0, __ATOMIC_RELAXED)))
+		fprintf(f, "DEBUG: %lu records dropped, trace ring is full\n",
+		  dropped);
+	if (f != stderr) {
+		fclose(f);
+		fwrite(buf, 1, size, stderr);
+		free(buf);
+	}
+	pthread_mutex_unlock(&trace.lock);
+}
+
+void trace_kick(void)
+{
+	uint64_t one = 1;
+
+	if (trace.efd >= 0)
+		write(trace.efd, &one, sizeof(one));
+	else
+		trace_flush();
+}
+
+static void *trace_thread(void *arg)
+{
+	struct pollfd pfd = { .fd = trace.efd, .events = POLLIN };
+	uint64_t n;
+
+	for (;;) {
+		__atomic_store_n(&trace.sleeping, 1, __ATOMIC_SEQ_CST);
+		/* Records pushed before producers could see us sleeping */
+		if (__atomic_load_n(&trace.tail, __ATOMIC_SEQ_CST)
+		  - __atomic_load_n(&trace.head, __ATOMIC_RELAXED)
+		  < TRACE_RECORDS / 2) {
+			while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+				;
+			read(trace.efd, &n, sizeof(n));
+		}
+		__atomic_store_n(&trace.sleeping, 0, __ATOMIC_RELAXED);
+		trace_flush();
+	}
+	return NULL;
+}
+
+static void trace_exit(void)
+{
+	trace_flush();
+}
+
+int trace_start(void)
+{
+	sigset_t all, old;
+	pthread_t tid;
+	int efd, err;
+
+	if (trace.efd >= 0)
+		return 0;
+	if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		return -1;
+	trace.efd = efd;
+	/* Signals are for the other threads */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&tid, NULL, trace_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		trace.efd = -1;
+		close(efd);
+		errno = err;
+		return -1;
+	}
+	pthread_detach(tid);
+	atexit(trace_exit);
+	return 0;
+}
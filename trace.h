@@ -0,0 +1,69 @@
+/*
+ * Debug trace: messages are stored as binary records in a static
+ * lock-free ring (MPSC, as tone ring) and formatted to stderr later,
+ * by the flusher thread or on trace_flush(). A record keeps format,
+ * which must be a string literal, and raw values of arguments, only
+ * strings are copied, so logging costs no formatting and, until the
+ * ring is half full, no syscalls. When the ring is full, records are
+ * dropped and counted.
+ *
+ * Supported conversions: d i u o x X c with h hh l ll j z t, e f g a
+ * E F G A, s, p, width and precision may be '*'.
+ *
+ * With NO_DEBUG trace is compiled out, functions are empty stubs.
+ *
+ * Copyright (C) 2021 Denis Kalashnikov <denis281089@gmail.com>
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#define TRACE_RECORDS 1024 /* Power of 2 */
+#define TRACE_ARGS 8       /* Arguments per record, the rest are lost */
+#define TRACE_STR 96       /* Bytes of copied strings per record */
+
+#ifndef NO_DEBUG
+
+/* Store record of DEBUG level */
+void trace_log(const char *frmt, ...) __attribute__((format(printf, 1, 2)));
+
+/*
+ * Start flusher thread. It sleeps until trace_kick() or until the
+ * ring is half full. Records left at exit are flushed too.
+ *
+ * Return: 0 -- Ok, <0 -- error (see errno),
+ */
+int trace_start(void);
+
+/* Format stored records to stderr now */
+void trace_flush(void);
+
+/*
+ * Flush records, e.g. at the end of melody: by flusher thread, if
+ * it runs, otherwise now.
+ */
+void trace_kick(void);
+
+#else
+
+static inline __attribute__((format(printf, 1, 2)))
+void trace_log(const char *frmt, ...)
+{
+}
+
+static inline int trace_start(void)
+{
+	return 0;
+}
+
+static inline void trace_flush(void)
+{
+}
+
+static inline void trace_kick(void)
+{
+}
+
+#endif
+
+#endif